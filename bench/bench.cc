@@ -1,9 +1,20 @@
 #include <benchmark/benchmark.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 extern "C" {
 
 #include <paralull.h>
 #include <liblfds.h>
+#ifdef PLL_HAVE_NUMA
+# include <numa.h>
+#endif
 
 }
 
@@ -102,4 +113,224 @@ BENCHMARK(paralull_mixed)
     ->Threads(64)
     ->Threads(128);
 
+static pll_mqueue mq;
+
+static void paralull_sharded_mixed(benchmark::State& state) {
+  if (state.thread_index == 0) {
+    mq = pll_mqueue_init(state.range_x(), NULL);
+  }
+  while (state.KeepRunning()) {
+    pll_mqueue_enqueue(mq, NULL);
+    pll_mqueue_dequeue(mq);
+  }
+  if (state.thread_index == 0) {
+    pll_mqueue_term(mq);
+  }
+}
+BENCHMARK(paralull_sharded_mixed)
+    ->Arg(4)
+    ->Arg(16)
+    ->Threads(1)
+    ->Threads(2)
+    ->Threads(4)
+    ->Threads(8)
+    ->Threads(16)
+    ->Threads(32)
+    ->Threads(64)
+    ->Threads(128);
+
+/*
+ * Cross-socket producer/consumer: even threads produce from the first NUMA
+ * node, odd threads consume from the last one. The argument selects where
+ * segments are placed:
+ *   0: default (first touch by the producers)
+ *   1: bound to the consumer node
+ *   2: interleaved across nodes
+ *   3: huge pages bound to the consumer node
+ */
+
+static char bench_item;
+
+static int bench_last_node() {
+#ifdef PLL_HAVE_NUMA
+  if (numa_available() >= 0)
+    return numa_max_node();
+#endif
+  return 0;
+}
+
+static void bench_run_on_node(int node) {
+#ifdef PLL_HAVE_NUMA
+  if (numa_available() >= 0)
+    numa_run_on_node(node);
+#else
+  (void) node;
+#endif
+}
+
+static void paralull_cross_socket(benchmark::State& state) {
+  int consumer_node = bench_last_node();
+
+  if (state.thread_index == 0) {
+    struct pll_queue_opts opts = pll_queue_opts();
+    switch (state.range_x()) {
+    case 1:
+      opts.numa_policy = PLL_NUMA_BIND;
+      opts.numa_node = consumer_node;
+      break;
+    case 2:
+      opts.numa_policy = PLL_NUMA_INTERLEAVE;
+      break;
+    case 3:
+      opts.numa_policy = PLL_NUMA_BIND;
+      opts.numa_node = consumer_node;
+      opts.hugepages = true;
+      break;
+    }
+    q = pll_queue_init_opts(&opts);
+  }
+
+  bool producer = state.thread_index % 2 == 0;
+  bench_run_on_node(producer ? 0 : consumer_node);
+
+  size_t items = 0;
+  while (state.KeepRunning()) {
+    if (producer) {
+      pll_enqueue(q, &bench_item);
+      ++items;
+    } else if (pll_dequeue(q) == &bench_item) {
+      ++items;
+    }
+  }
+  state.SetItemsProcessed(items);
+
+  if (state.thread_index == 0) {
+    pll_queue_term(q);
+  }
+}
+BENCHMARK(paralull_cross_socket)
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(3)
+    ->Threads(2)
+    ->Threads(4)
+    ->Threads(8)
+    ->Threads(16)
+    ->Threads(32)
+    ->Threads(64);
+
+/*
+ * Task throughput: submit a burst of no-op tasks and wait for all of them,
+ * against a std::mutex/std::condition_variable pool doing the same.
+ */
+
+static const size_t task_burst = 10000;
+static std::atomic<size_t> tasks_done;
+
+static void bench_task_run(struct pll_task *) {
+  tasks_done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void run_task_bursts(benchmark::State& state,
+                            std::function<void(struct pll_task *)> submit) {
+  std::vector<struct pll_task> tasks(task_burst);
+  for (auto& t : tasks)
+    t.run = bench_task_run;
+
+  while (state.KeepRunning()) {
+    tasks_done = 0;
+    for (auto& t : tasks)
+      submit(&t);
+    while (tasks_done.load() != task_burst)
+      std::this_thread::yield();
+  }
+  state.SetItemsProcessed(state.iterations() * task_burst);
+}
+
+static void paralull_executor(benchmark::State& state) {
+  struct pll_executor_opts opts = pll_executor_opts();
+  opts.workers = state.range_x();
+  opts.pin = true;
+  opts.steal = state.range_y();
+
+  pll_executor ex = pll_executor_init(&opts);
+  run_task_bursts(state, [ex](struct pll_task *t) {
+    pll_executor_submit(ex, t);
+  });
+  pll_executor_term(ex);
+}
+BENCHMARK(paralull_executor)
+    ->ArgPair(1, 0)
+    ->ArgPair(2, 0)
+    ->ArgPair(4, 0)
+    ->ArgPair(8, 0)
+    ->ArgPair(16, 0)
+    ->ArgPair(1, 1)
+    ->ArgPair(2, 1)
+    ->ArgPair(4, 1)
+    ->ArgPair(8, 1)
+    ->ArgPair(16, 1);
+
+class mutex_pool {
+public:
+  explicit mutex_pool(size_t workers) {
+    for (size_t i = 0; i < workers; ++i)
+      threads_.emplace_back([this] { run(); });
+  }
+
+  ~mutex_pool() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_)
+      t.join();
+  }
+
+  void submit(struct pll_task *task) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      tasks_.push_back(task);
+    }
+    cond_.notify_one();
+  }
+
+private:
+  void run() {
+    for (;;) {
+      struct pll_task *task;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          return;
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+      task->run(task);
+    }
+  }
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::deque<struct pll_task *> tasks_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+};
+
+static void mutex_pool_executor(benchmark::State& state) {
+  mutex_pool pool(state.range_x());
+  run_task_bursts(state, [&pool](struct pll_task *t) {
+    pool.submit(t);
+  });
+}
+BENCHMARK(mutex_pool_executor)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(4)
+    ->Arg(8)
+    ->Arg(16);
+
 BENCHMARK_MAIN()
@@ -2,19 +2,171 @@
 # define PARALULL_H_
 
 # include <stdbool.h>
+# include <stddef.h>
 
 # ifdef __cplusplus
 struct _pll_queue;
 typedef _pll_queue *pll_queue;
+struct _pll_mqueue;
+typedef _pll_mqueue *pll_mqueue;
+struct _pll_executor;
+typedef _pll_executor *pll_executor;
 # else
 struct pll_queue;
 typedef struct pll_queue *pll_queue;
+struct pll_mqueue;
+typedef struct pll_mqueue *pll_mqueue;
+struct pll_executor;
+typedef struct pll_executor *pll_executor;
 # endif
 
+/* Returned by the dequeue functions when there is nothing to dequeue */
+# define PLL_QUEUE_EMPTY ((void *)-7)
+
+# define PLL_QUEUE_MAX_LANES 8
+
+enum pll_numa_policy {
+	PLL_NUMA_DEFAULT,       /* first-touch, wherever the allocating thread runs */
+	PLL_NUMA_BIND,          /* place every segment on numa_node */
+	PLL_NUMA_INTERLEAVE,    /* interleave segment pages across all nodes */
+};
+
+/*
+ * Allocator used for every piece of queue memory (the queue itself, its
+ * segments, handles and scratch space). alloc must return memory suitably
+ * aligned for any type, free is given back the size that was requested.
+ */
+struct pll_allocator {
+	void *(*alloc)(size_t size, void *ctx);
+	void (*free)(void *ptr, size_t size, void *ctx);
+	void *ctx;
+};
+
+struct pll_queue_opts {
+	enum pll_numa_policy numa_policy;
+	int numa_node;
+	/* carve segments from 2 MB huge pages instead of the C heap */
+	bool hugepages;
+	/* replaces the C heap; exclusive with numa_policy and hugepages */
+	struct pll_allocator allocator;
+	/*
+	 * Map segments from an unlinked file created in spill_dir and keep at
+	 * most about spill_resident of them (64 if 0) in memory: cold segments
+	 * between head and tail are paged out to the file and read back ahead
+	 * of head, and the blocks of drained segments go back to the file
+	 * system. Only the stored pointers are spilled, not what they point
+	 * to. Exclusive with every other memory option.
+	 */
+	const char *spill_dir;
+	size_t spill_resident;
+	/*
+	 * Number of priority levels, 1 if 0 and at most PLL_QUEUE_MAX_LANES.
+	 * Each level has its own segments and head/tail counters, and dequeues
+	 * serve the highest non-empty level first.
+	 */
+	size_t lanes;
+};
+
 pll_queue pll_queue_init(void);
+pll_queue pll_queue_init_opts(const struct pll_queue_opts *opts);
 void pll_queue_term(pll_queue q);
 void pll_enqueue(pll_queue q, void *val);
+/* Enqueue at priority prio, 0 being the pll_enqueue() level and the lowest */
+void pll_enqueue_prio(pll_queue q, void *val, unsigned prio);
 void *pll_dequeue(pll_queue q);
+/* Dequeue up to n items into vals, stopping at the first empty dequeue */
+size_t pll_dequeue_batch(pll_queue q, void **vals, size_t n);
 bool pll_queue_empty(pll_queue q);
 
+/*
+ * Number of items in the queue, read from the head and tail counters with
+ * two relaxed loads. Exact on a quiescent queue that never went through the
+ * slow path. Otherwise each operation running concurrently with the call can
+ * shift the result by one, and cells abandoned by contended enqueues count
+ * as items until a dequeue skips past them. Dequeues on an empty queue never
+ * make it negative.
+ */
+size_t pll_queue_size_approx(pll_queue q);
+
+/* Number of segments currently allocated by the queue */
+size_t pll_queue_segments(pll_queue q);
+
+/* Queues pll_dequeue_any() can park on without allocating */
+# define PLL_ANY_STACK_QUEUES 16
+
+enum pll_any_fairness {
+	PLL_ANY_ORDERED,    /* poll in array order, earlier queues win */
+	PLL_ANY_ROTATE,     /* start right after *index, the last queue served */
+};
+
+/*
+ * Dequeue from whichever of the n queues has an item, storing its position
+ * in *index. When all of them are empty, park for up to timeout_ms (forever
+ * if negative, not at all if 0) until one of them is enqueued to, and return
+ * PLL_QUEUE_EMPTY on timeout. PLL_ANY_ROTATE serves busy queues round-robin
+ * so none of them starves.
+ *
+ * index must not be NULL, and with PLL_ANY_ROTATE it must be initialised on
+ * the first call, e.g. to n - 1 to start with the first queue. Parking on more
+ * than PLL_ANY_STACK_QUEUES queues allocates, and PLL_QUEUE_EMPTY is returned
+ * with errno set to ENOMEM when that fails.
+ */
+void *pll_dequeue_any(pll_queue *queues, size_t n, long timeout_ms,
+                      size_t *index, enum pll_any_fairness fairness);
+
+/*
+ * Sharded queue spreading operations over several pll_queue. Ordering is
+ * relaxed to per-producer FIFO: a thread always enqueues to its home shard,
+ * so its items are dequeued in the order it enqueued them, but items from
+ * different producers are not ordered. Dequeues start at the home shard and
+ * steal from the other non-empty shards, so PLL_QUEUE_EMPTY only means that
+ * every shard looked empty when it was visited.
+ */
+pll_mqueue pll_mqueue_init(size_t shards, const struct pll_queue_opts *opts);
+void pll_mqueue_term(pll_mqueue mq);
+void pll_mqueue_enqueue(pll_mqueue mq, void *val);
+void *pll_mqueue_dequeue(pll_mqueue mq);
+size_t pll_mqueue_dequeue_batch(pll_mqueue mq, void **vals, size_t n);
+size_t pll_mqueue_size_approx(pll_mqueue mq);
+
+/*
+ * Pin the home shard of the calling thread instead of the round-robin
+ * default. Per-producer FIFO only holds between items enqueued with the same
+ * home shard.
+ */
+int pll_mqueue_bind(pll_mqueue mq, size_t shard);
+
+/*
+ * Intrusive task: embed it in your own structure and recover the latter
+ * from run(). The executor never allocates per task.
+ */
+struct pll_task {
+	void (*run)(struct pll_task *task);
+};
+
+struct pll_executor_opts {
+	/* number of workers, one per CPU the process may run on if 0 */
+	size_t workers;
+	/* pin worker i to the i-th CPU of the process affinity mask, modulo */
+	bool pin;
+	/*
+	 * Give each worker its own run-queue and let idle workers steal from
+	 * the others, instead of sharing a single run-queue.
+	 */
+	bool steal;
+	/* tasks taken per dequeue round, 32 if 0 */
+	size_t batch;
+	/* options of the underlying run-queue(s) */
+	struct pll_queue_opts queue;
+};
+
+/*
+ * Fixed pool of workers running tasks out of wait-free run-queues. Idle
+ * workers sleep until a task is submitted. pll_executor_term() runs every
+ * task submitted before it returns, including the ones submitted by tasks.
+ */
+pll_executor pll_executor_init(const struct pll_executor_opts *opts);
+void pll_executor_term(pll_executor ex);
+void pll_executor_submit(pll_executor ex, struct pll_task *task);
+
 #endif /* !PARALULL_H_ */
@@ -0,0 +1,171 @@
+#ifndef PARALULL_HPP_
+# define PARALULL_HPP_
+
+# if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#  error "paralull.hpp requires C++20 coroutines"
+# endif
+
+# include <atomic>
+# include <coroutine>
+# include <cstdint>
+# include <cstdlib>
+# include <new>
+
+extern "C" {
+
+# include <paralull.h>
+
+}
+
+namespace pll {
+
+/*
+ * Queue of T * whose consumers are coroutines: co_await q.pop() suspends the
+ * caller on an empty queue instead of blocking its thread. push() hands the
+ * item straight to the oldest suspended consumer and resumes it on the
+ * executor given at construction, or inline on the pushing thread without
+ * one.
+ *
+ * Suspended consumers wait in a second wait-free queue. The awaiter lives in
+ * the coroutine frame and carries the pll_task used to resume it, so the
+ * handoff does not allocate.
+ *
+ * Neither side ever waits for the other: items and waiters are published in
+ * their queue before being counted, so whoever reserves an entry through the
+ * counter finds it already there. The counter is a single CAS loop, the
+ * handoff is lock-free.
+ */
+template <typename T>
+class co_queue {
+public:
+  class awaiter;
+
+  explicit co_queue(pll_executor ex = nullptr)
+    : ex_(ex), items_(pll_queue_init()), waiters_(pll_queue_init()) {
+    if (!items_ || !waiters_) {
+      term();
+      throw std::bad_alloc();
+    }
+  }
+
+  ~co_queue() { term(); }
+
+  co_queue(const co_queue&) = delete;
+  co_queue& operator=(const co_queue&) = delete;
+
+  void push(T *val) {
+    pll_enqueue(items_, val);
+    /* A negative count means suspended consumers: match one with an item */
+    if (count_.fetch_add(1, std::memory_order_acq_rel) < 0)
+      handoff(nullptr);
+  }
+
+  awaiter pop() { return awaiter(this); }
+
+  /* Non-suspending pop, false when no item is available */
+  bool try_pop(T *&val) {
+    if (!reserve())
+      return false;
+    val = static_cast<T *>(take(items_));
+    return true;
+  }
+
+  class awaiter {
+  public:
+    bool await_ready() noexcept {
+      if (!q_->reserve())
+        return false;
+      val_ = static_cast<T *>(take(q_->items_));
+      return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept {
+      co_queue *q = q_;
+
+      handle_ = handle;
+      pll_enqueue(q->waiters_, this);
+      /*
+       * From here on we may be resumed by a pusher at any time: do not touch
+       * *this unless handoff() gives it back to us.
+       */
+      if (q->count_.fetch_sub(1, std::memory_order_acq_rel) > 0)
+        return q->handoff(this);
+      return true;
+    }
+
+    T *await_resume() noexcept { return val_; }
+
+  private:
+    friend class co_queue;
+
+    explicit awaiter(co_queue *q) : task_{&awaiter::run}, q_(q) {}
+
+    static void run(struct pll_task *task) {
+      /* task_ is the first member of a standard-layout class */
+      reinterpret_cast<awaiter *>(task)->handle_.resume();
+    }
+
+    void resume() {
+      if (q_->ex_)
+        pll_executor_submit(q_->ex_, &task_);
+      else
+        handle_.resume();
+    }
+
+    struct pll_task task_;
+    co_queue *q_;
+    std::coroutine_handle<> handle_;
+    T *val_ = nullptr;
+  };
+
+private:
+  /* Claims an item already counted, without ever going negative */
+  bool reserve() {
+    int64_t c = count_.load(std::memory_order_acquire);
+    while (c > 0 && !count_.compare_exchange_weak(c, c - 1,
+                                                  std::memory_order_acq_rel))
+      ;
+    return c > 0;
+  }
+
+  /*
+   * Gives the oldest item to the oldest waiter, both counted and so already
+   * published. Returns false when that waiter is self, which then carries on
+   * without suspending.
+   */
+  bool handoff(awaiter *self) {
+    awaiter *w = static_cast<awaiter *>(take(waiters_));
+
+    w->val_ = static_cast<T *>(take(items_));
+    if (w == self)
+      return false;
+    w->resume();
+    return true;
+  }
+
+  static void *take(pll_queue q) {
+    void *val = pll_dequeue(q);
+
+    /* The counter only ever hands out entries that were published */
+    if (val == PLL_QUEUE_EMPTY)
+      std::abort();
+    return val;
+  }
+
+  void term() {
+    if (items_)
+      pll_queue_term(items_);
+    if (waiters_)
+      pll_queue_term(waiters_);
+  }
+
+  pll_executor ex_;
+  pll_queue items_;
+  pll_queue waiters_;
+  /* published items minus published waiters, on its own cache line */
+  alignas(64) std::atomic<int64_t> count_{0};
+};
+
+} // namespace pll
+
+#endif /* !PARALULL_HPP_ */
@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef PLL_HAVE_NUMA
+# include <numa.h>
+#endif
+
+#include "alloc.h"
+#include "atomic.h"
+#include "queue.h"
+#include "spill.h"
+
+#define HUGEPAGE_SIZE   (2UL << 20)
+#define CACHELINE_SIZE  64
+
+#define ROUND_UP(Val, Align) (((Val) + (Align) - 1) & ~((Align) - 1))
+
+void *mem_alloc(const struct pll_allocator *a, size_t size)
+{
+	return a->alloc ? a->alloc(size, a->ctx) : malloc(size);
+}
+
+void mem_free(const struct pll_allocator *a, void *ptr, size_t size)
+{
+	if (a->free)
+		a->free(ptr, size, a->ctx);
+	else
+		free(ptr);
+}
+
+int queue_alloc_check(const struct pll_queue_opts *opts)
+{
+	if (opts->allocator.alloc || opts->allocator.free) {
+		if (!opts->allocator.alloc || !opts->allocator.free)
+			return -EINVAL;
+		if (opts->hugepages || opts->numa_policy != PLL_NUMA_DEFAULT)
+			return -EINVAL;
+	}
+	if (opts->spill_dir && (opts->hugepages || opts->allocator.alloc
+			|| opts->numa_policy != PLL_NUMA_DEFAULT))
+		return -EINVAL;
+	if (opts->numa_policy == PLL_NUMA_DEFAULT)
+		return 0;
+#ifdef PLL_HAVE_NUMA
+	if (numa_available() < 0)
+		return -ENOTSUP;
+	if (opts->numa_policy == PLL_NUMA_BIND)
+		return (opts->numa_node < 0 || opts->numa_node > numa_max_node())
+			? -EINVAL : 0;
+	return opts->numa_policy == PLL_NUMA_INTERLEAVE ? 0 : -EINVAL;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static void place_memory(struct pll_queue *q, void *mem, size_t size)
+{
+#ifdef PLL_HAVE_NUMA
+	/* Must happen before the first touch to have any effect */
+	if (q->opts.numa_policy == PLL_NUMA_BIND)
+		numa_tonode_memory(mem, size, q->opts.numa_node);
+	else if (q->opts.numa_policy == PLL_NUMA_INTERLEAVE)
+		numa_interleave_memory(mem, size, numa_all_nodes_ptr);
+#else
+	(void) q;
+	(void) mem;
+	(void) size;
+#endif
+}
+
+static struct queue_chunk *chunk_init(void *mem, size_t size, size_t align)
+{
+	struct queue_chunk *c = mem;
+
+	c->next = NULL;
+	c->size = size;
+	c->off = 0;
+	c->released = 0;
+	c->dead = NULL;
+	c->unlinked = false;
+	c->used = ROUND_UP(sizeof (*c), align);
+	return c;
+}
+
+static struct queue_chunk *hugepage_map(struct pll_queue *q)
+{
+	char *mem = mmap(NULL, HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		/*
+		 * No reserved huge pages: map twice the size to get a 2 MB aligned
+		 * range and ask for a transparent huge page instead.
+		 */
+		mem = mmap(NULL, 2 * HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+
+		char *aligned = (char *)ROUND_UP((uintptr_t)mem, HUGEPAGE_SIZE);
+		if (aligned != mem)
+			munmap(mem, aligned - mem);
+		munmap(aligned + HUGEPAGE_SIZE, mem + HUGEPAGE_SIZE - aligned);
+		mem = aligned;
+		madvise(mem, HUGEPAGE_SIZE, MADV_HUGEPAGE);
+	}
+	place_memory(q, mem, HUGEPAGE_SIZE);
+	return chunk_init(mem, HUGEPAGE_SIZE, CACHELINE_SIZE);
+}
+
+static struct queue_chunk *spill_chunk_map(struct pll_queue *q)
+{
+	/* Page aligned segments so that each one can be paged out on its own */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = page + SPILL_CHUNK_SEGMENTS * spill_stride();
+
+	uint64_t off;
+	void *mem = spill_map(q, size, &off);
+	if (!mem)
+		return NULL;
+
+	struct queue_chunk *c = chunk_init(mem, size, page);
+	c->off = off;
+	return c;
+}
+
+static void *chunk_carve(struct pll_queue *q, size_t size)
+{
+	bool spill = q->opts.spill_dir != NULL;
+	void *seg = NULL;
+
+	size = spill ? spill_stride() : ROUND_UP(size, CACHELINE_SIZE);
+
+	/* Drained spill chunks are only unmapped while nobody is in here */
+	if (spill)
+		pll_faa(&q->spill.carvers, 1);
+
+	for (;;) {
+		struct queue_chunk *c = q->chunks;
+
+		if (c) {
+			uint64_t off = pll_faa(&c->used, size);
+			if (off + size <= c->size) {
+				seg = (char *)c + off;
+				break;
+			}
+		}
+
+		/* Current chunk is exhausted, try to install a fresh one */
+		struct queue_chunk *n = spill ? spill_chunk_map(q) : hugepage_map(q);
+		if (!n)
+			break;
+		n->next = c;
+		if (pll_cas(&q->chunks, c, n))
+			continue;
+		if (spill)
+			spill_unmap(q, n);
+		else
+			munmap(n, n->size);
+	}
+
+	if (spill)
+		pll_fas(&q->spill.carvers, 1);
+	return seg;
+}
+
+int queue_alloc_init(struct pll_queue *q)
+{
+	return q->opts.spill_dir ? spill_open(q) : 0;
+}
+
+struct queue_segment *segment_alloc(struct pll_queue *q)
+{
+	size_t size = sizeof (struct queue_segment);
+
+	if (q->opts.hugepages || q->opts.spill_dir)
+		return chunk_carve(q, size);
+
+#ifdef PLL_HAVE_NUMA
+	if (q->opts.numa_policy == PLL_NUMA_BIND)
+		return numa_alloc_onnode(size, q->opts.numa_node);
+	if (q->opts.numa_policy == PLL_NUMA_INTERLEAVE)
+		return numa_alloc_interleaved(size);
+#endif
+	return mem_alloc(&q->opts.allocator, size);
+}
+
+void segment_free(struct pll_queue *q, struct queue_segment *seg)
+{
+	if (q->opts.hugepages || q->opts.spill_dir)
+		return;
+
+#ifdef PLL_HAVE_NUMA
+	if (q->opts.numa_policy != PLL_NUMA_DEFAULT) {
+		numa_free(seg, sizeof (*seg));
+		return;
+	}
+#endif
+	mem_free(&q->opts.allocator, seg, sizeof (*seg));
+}
+
+void queue_alloc_term(struct pll_queue *q)
+{
+	/* Before the list goes: spill_close() reads drained chunks still in it */
+	if (q->opts.spill_dir)
+		spill_close(q);
+	for (struct queue_chunk *c = q->chunks; c; ) {
+		struct queue_chunk *next = c->next;
+		munmap(c, c->size);
+		c = next;
+	}
+	q->chunks = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef _PLL_ALLOC_H
+#define _PLL_ALLOC_H
+
+#include <stdbool.h>
+
+#include "queue.h"
+
+/*
+ * A chunk is a 2 MB huge page or a window of the spill file that segments are
+ * carved from. Carved segments are never released individually, the whole
+ * chunk goes away with the queue.
+ */
+struct queue_chunk {
+	struct queue_chunk *next;
+	size_t size;
+	uint64_t used;
+	/* offset of the chunk in the spill file */
+	uint64_t off;
+	/* spill mode: segments given back to the file, next drained chunk */
+	uint64_t released;
+	struct queue_chunk *dead;
+	bool unlinked;
+};
+
+void *mem_alloc(const struct pll_allocator *a, size_t size);
+void mem_free(const struct pll_allocator *a, void *ptr, size_t size);
+
+int queue_alloc_check(const struct pll_queue_opts *opts);
+int queue_alloc_init(struct pll_queue *q);
+void queue_alloc_term(struct pll_queue *q);
+struct queue_segment *segment_alloc(struct pll_queue *q);
+void segment_free(struct pll_queue *q, struct queue_segment *seg);
+
+#endif /* _PLL_ALLOC_H */
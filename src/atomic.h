@@ -5,6 +5,7 @@
 # define pll_faa(Ptr, Val) (__sync_fetch_and_add((Ptr), (Val)))
 # define pll_fas(Ptr, Val) (__sync_fetch_and_sub((Ptr), (Val)))
 # define pll_barrier() (__sync_synchronize())
+# define pll_load(Ptr) (__atomic_load_n((Ptr), __ATOMIC_RELAXED))
 
 # define pll_aset(Var, Val) __extension__ ({        \
 		__typeof__(Var) tmp;                        \
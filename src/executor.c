@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "atomic.h"
+#include "paralull.h"
+
+#define DEFAULT_BATCH 32
+
+struct executor_worker {
+	pll_executor ex;
+	size_t id;
+	pthread_t thread;
+	void **tasks;
+};
+
+struct pll_executor {
+	struct pll_executor_opts opts;
+	/* shared run-queue, or one per worker when stealing */
+	pll_queue q;
+	pll_mqueue mq;
+	struct executor_worker *workers;
+	/* CPUs the process may run on, workers are pinned among them */
+	cpu_set_t cpus;
+
+	/* parking: workers sleep on cond until epoch moves */
+	uint64_t idle;
+	uint64_t epoch;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static size_t runq_take(pll_executor ex, void **tasks, size_t n)
+{
+	if (ex->mq)
+		return pll_mqueue_dequeue_batch(ex->mq, tasks, n);
+	return pll_dequeue_batch(ex->q, tasks, n);
+}
+
+static bool runq_empty(pll_executor ex)
+{
+	if (ex->mq)
+		return pll_mqueue_size_approx(ex->mq) == 0;
+	return pll_queue_empty(ex->q);
+}
+
+/* Returns true when the worker should exit */
+static bool park(pll_executor ex)
+{
+	uint64_t epoch = pll_load(&ex->epoch);
+
+	/*
+	 * Announce ourselves before the last emptiness check: a submitter either
+	 * sees idle != 0 and bumps the epoch, or we see its task.
+	 */
+	pll_faa(&ex->idle, 1);
+	if (!runq_empty(ex)) {
+		pll_fas(&ex->idle, 1);
+		return false;
+	}
+	if (pll_load(&ex->stop)) {
+		pll_fas(&ex->idle, 1);
+		return true;
+	}
+
+	pthread_mutex_lock(&ex->lock);
+	while (ex->epoch == epoch && !ex->stop)
+		pthread_cond_wait(&ex->cond, &ex->lock);
+	pthread_mutex_unlock(&ex->lock);
+
+	pll_fas(&ex->idle, 1);
+	return false;
+}
+
+static void *worker_run(void *arg)
+{
+	struct executor_worker *w = arg;
+	pll_executor ex = w->ex;
+
+	if (ex->mq && pll_mqueue_bind(ex->mq, w->id) < 0)
+		abort();
+
+	for (;;) {
+		size_t n = runq_take(ex, w->tasks, ex->opts.batch);
+
+		for (size_t i = 0; i < n; ++i) {
+			struct pll_task *task = w->tasks[i];
+			task->run(task);
+		}
+		if (!n && park(ex))
+			break;
+	}
+	return NULL;
+}
+
+static int worker_start(pll_executor ex, struct executor_worker *w)
+{
+	pthread_attr_t attr;
+	int rc;
+
+	if ((rc = pthread_attr_init(&attr)))
+		return -rc;
+
+	if (ex->opts.pin) {
+		size_t nth = w->id % CPU_COUNT(&ex->cpus);
+		cpu_set_t set;
+		int cpu = 0;
+
+		/* The nth allowed CPU, not the nth online one */
+		for (;; ++cpu)
+			if (CPU_ISSET(cpu, &ex->cpus) && !nth--)
+				break;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if ((rc = pthread_attr_setaffinity_np(&attr, sizeof (set), &set)))
+			goto out;
+	}
+	rc = pthread_create(&w->thread, &attr, worker_run, w);
+out:
+	pthread_attr_destroy(&attr);
+	return -rc;
+}
+
+static void allowed_cpus(cpu_set_t *set)
+{
+	if (!sched_getaffinity(0, sizeof (*set), set) && CPU_COUNT(set))
+		return;
+
+	/* Affinity unknown, e.g. more CPUs than a cpu_set_t holds */
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(set);
+	for (long i = 0; i < (cpus > 0 ? cpus : 1) && i < CPU_SETSIZE; ++i)
+		CPU_SET(i, set);
+}
+
+static void executor_stop(pll_executor ex)
+{
+	pthread_mutex_lock(&ex->lock);
+	ex->stop = true;
+	pthread_cond_broadcast(&ex->cond);
+	pthread_mutex_unlock(&ex->lock);
+}
+
+static void executor_free(pll_executor ex)
+{
+	struct pll_allocator a = ex->opts.queue.allocator;
+	size_t nworkers = ex->opts.workers;
+
+	if (ex->workers) {
+		for (size_t i = 0; i < nworkers; ++i)
+			if (ex->workers[i].tasks)
+				mem_free(&a, ex->workers[i].tasks,
+				         sizeof (void *) * ex->opts.batch);
+		mem_free(&a, ex->workers, sizeof (*ex->workers) * nworkers);
+	}
+	if (ex->mq)
+		pll_mqueue_term(ex->mq);
+	if (ex->q)
+		pll_queue_term(ex->q);
+	pthread_cond_destroy(&ex->cond);
+	pthread_mutex_destroy(&ex->lock);
+	mem_free(&a, ex, sizeof (*ex));
+}
+
+pll_executor pll_executor_init(const struct pll_executor_opts *opts)
+{
+	static const struct pll_executor_opts default_opts;
+	int rc = 0;
+
+	if (!opts)
+		opts = &default_opts;
+
+	pll_executor ex = mem_alloc(&opts->queue.allocator, sizeof (*ex));
+	if (!ex) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	*ex = (struct pll_executor) {
+		.opts = *opts,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	allowed_cpus(&ex->cpus);
+	if (!ex->opts.workers)
+		ex->opts.workers = CPU_COUNT(&ex->cpus);
+	if (!ex->opts.batch)
+		ex->opts.batch = DEFAULT_BATCH;
+
+	size_t nworkers = ex->opts.workers;
+
+	if (ex->opts.steal)
+		ex->mq = pll_mqueue_init(nworkers, &opts->queue);
+	else
+		ex->q = pll_queue_init_opts(&opts->queue);
+	if (!ex->mq && !ex->q) {
+		rc = errno;
+		goto err;
+	}
+
+	ex->workers = mem_alloc(&opts->queue.allocator,
+	                        sizeof (*ex->workers) * nworkers);
+	if (!ex->workers) {
+		rc = ENOMEM;
+		goto err;
+	}
+	for (size_t i = 0; i < nworkers; ++i)
+		ex->workers[i] = (struct executor_worker) { .ex = ex, .id = i };
+	for (size_t i = 0; i < nworkers; ++i) {
+		ex->workers[i].tasks = mem_alloc(&opts->queue.allocator,
+		                                 sizeof (void *) * ex->opts.batch);
+		if (!ex->workers[i].tasks) {
+			rc = ENOMEM;
+			goto err;
+		}
+	}
+
+	size_t started = 0;
+	for (; started < nworkers; ++started)
+		if ((rc = -worker_start(ex, &ex->workers[started])))
+			goto err_workers;
+
+	return ex;
+
+err_workers:
+	executor_stop(ex);
+	while (started > 0)
+		pthread_join(ex->workers[--started].thread, NULL);
+err:
+	executor_free(ex);
+	errno = rc;
+	return NULL;
+}
+
+void pll_executor_term(pll_executor ex)
+{
+	executor_stop(ex);
+	for (size_t i = 0; i < ex->opts.workers; ++i)
+		pthread_join(ex->workers[i].thread, NULL);
+	executor_free(ex);
+}
+
+void pll_executor_submit(pll_executor ex, struct pll_task *task)
+{
+	if (ex->mq)
+		pll_mqueue_enqueue(ex->mq, task);
+	else
+		pll_enqueue(ex->q, task);
+
+	/* Pairs with the idle announcement in park() */
+	pll_barrier();
+	if (pll_load(&ex->idle)) {
+		pthread_mutex_lock(&ex->lock);
+		++ex->epoch;
+		pthread_cond_signal(&ex->cond);
+		pthread_mutex_unlock(&ex->lock);
+	}
+}
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+#include "atomic.h"
+#include "paralull.h"
+
+struct pll_mqueue {
+	size_t nshards;
+	pll_queue *shards;
+	uint64_t next_home;
+	pthread_key_t homek;
+	struct pll_allocator allocator;
+};
+
+pll_mqueue pll_mqueue_init(size_t shards, const struct pll_queue_opts *opts)
+{
+	static const struct pll_queue_opts default_opts;
+	int rc = 0;
+
+	if (!opts)
+		opts = &default_opts;
+	if (!shards) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pll_mqueue mq = mem_alloc(&opts->allocator, sizeof (*mq));
+	if (!mq) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	*mq = (struct pll_mqueue) {
+		.nshards = shards,
+		.allocator = opts->allocator,
+	};
+
+	if ((rc = pthread_key_create(&mq->homek, NULL)))
+		goto err_key;
+
+	mq->shards = mem_alloc(&opts->allocator, sizeof (*mq->shards) * shards);
+	if (!mq->shards) {
+		rc = ENOMEM;
+		goto err_shards;
+	}
+
+	size_t i = 0;
+	for (; i < shards; ++i) {
+		if (!(mq->shards[i] = pll_queue_init_opts(opts))) {
+			rc = errno;
+			goto err_queues;
+		}
+	}
+	return mq;
+
+err_queues:
+	while (i > 0)
+		pll_queue_term(mq->shards[--i]);
+	mem_free(&opts->allocator, mq->shards, sizeof (*mq->shards) * shards);
+err_shards:
+	pthread_key_delete(mq->homek);
+err_key:
+	mem_free(&opts->allocator, mq, sizeof (*mq));
+	errno = rc;
+	return NULL;
+}
+
+void pll_mqueue_term(pll_mqueue mq)
+{
+	struct pll_allocator a = mq->allocator;
+
+	for (size_t i = 0; i < mq->nshards; ++i)
+		pll_queue_term(mq->shards[i]);
+	mem_free(&a, mq->shards, sizeof (*mq->shards) * mq->nshards);
+	pthread_key_delete(mq->homek);
+	mem_free(&a, mq, sizeof (*mq));
+}
+
+int pll_mqueue_bind(pll_mqueue mq, size_t shard)
+{
+	if (shard >= mq->nshards)
+		return -EINVAL;
+	/* Store shard + 1 so that NULL still means "not assigned yet" */
+	return -pthread_setspecific(mq->homek, (void *)(uintptr_t)(shard + 1));
+}
+
+static size_t home_shard(pll_mqueue mq)
+{
+	uintptr_t home = (uintptr_t)pthread_getspecific(mq->homek);
+
+	if (!home) {
+		home = pll_faa(&mq->next_home, 1) % mq->nshards + 1;
+		if (pthread_setspecific(mq->homek, (void *)home))
+			abort();
+	}
+	return home - 1;
+}
+
+void pll_mqueue_enqueue(pll_mqueue mq, void *val)
+{
+	pll_enqueue(mq->shards[home_shard(mq)], val);
+}
+
+void *pll_mqueue_dequeue(pll_mqueue mq)
+{
+	size_t home = home_shard(mq);
+
+	for (size_t i = 0; i < mq->nshards; ++i) {
+		pll_queue q = mq->shards[(home + i) % mq->nshards];
+
+		/* Skip empty shards rather than burning a cell in each */
+		if (pll_queue_empty(q))
+			continue;
+
+		void *val = pll_dequeue(q);
+		if (val != PLL_QUEUE_EMPTY)
+			return val;
+	}
+	return PLL_QUEUE_EMPTY;
+}
+
+size_t pll_mqueue_dequeue_batch(pll_mqueue mq, void **vals, size_t n)
+{
+	size_t home = home_shard(mq);
+	size_t taken = 0;
+
+	for (size_t i = 0; i < mq->nshards && taken < n; ++i) {
+		pll_queue q = mq->shards[(home + i) % mq->nshards];
+		taken += pll_dequeue_batch(q, vals + taken, n - taken);
+	}
+	return taken;
+}
+
+size_t pll_mqueue_size_approx(pll_mqueue mq)
+{
+	size_t size = 0;
+
+	for (size_t i = 0; i < mq->nshards; ++i)
+		size += pll_queue_size_approx(mq->shards[i]);
+	return size;
+}
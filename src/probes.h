@@ -0,0 +1,19 @@
+#ifndef _PLL_PROBES_H
+#define _PLL_PROBES_H
+
+/*
+ * USDT probes of the "paralull" provider. Each one is a single nop until a
+ * tracer attaches to it; see tools/bpftrace for examples. They are compiled
+ * in when systemtap's <sys/sdt.h> is found (PLL_USDT option), and expand to
+ * nothing otherwise.
+ */
+#ifdef PLL_HAVE_SDT
+# include <sys/sdt.h>
+# define PLL_PROBE2(Name, A, B) DTRACE_PROBE2(paralull, Name, A, B)
+# define PLL_PROBE3(Name, A, B, C) DTRACE_PROBE3(paralull, Name, A, B, C)
+#else
+# define PLL_PROBE2(Name, A, B) do { } while (0)
+# define PLL_PROBE3(Name, A, B, C) do { } while (0)
+#endif
+
+#endif /* _PLL_PROBES_H */
@@ -1,13 +1,17 @@
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdint.h>
 
+#include "alloc.h"
 #include "atomic.h"
 #include "paralull.h"
+#include "probes.h"
 #include "queue.h"
-#include "atomic.h"
+#include "spill.h"
+#include "wait.h"
 
 #define PATIENCE    10
 #define MAX_GARBAGE 8
@@ -18,13 +22,16 @@
 #define ENQUEUE_BOTTOM  ((void *)-4)
 #define QUEUE_TOP       ((void *)-5)
 #define QUEUE_BOTTOM    ((void *)-6)
-#define QUEUE_EMPTY     ((void *)-7)
+#define QUEUE_EMPTY     PLL_QUEUE_EMPTY
 
-static struct queue_segment *new_segment(uint64_t id)
+static struct queue_segment *new_segment(pll_queue q, uint64_t id)
 {
-	struct queue_segment *seg = calloc(1, sizeof(struct queue_segment));
+	struct queue_segment *seg = segment_alloc(q);
+	if (!seg)
+		return NULL;
 
 	pll_aset(seg->id, id);
+	pll_aset(seg->next, NULL);
 	for (size_t i = 0; i < CELLS_NUMBER; ++i) {
 		pll_aset(seg->cells[i].val, QUEUE_BOTTOM);
 		pll_aset(seg->cells[i].enq, ENQUEUE_BOTTOM);
@@ -35,9 +42,12 @@ static struct queue_segment *new_segment(uint64_t id)
 
 static int handle_init(struct pll_queue *q, struct queue_handle **out)
 {
-	struct queue_handle *h = malloc(sizeof (*h));
+	struct queue_handle *h = mem_alloc(&q->opts.allocator, sizeof (*h));
+	int rc;
+
+	/* Allocator hooks are not required to set errno */
 	if (!h)
-		goto err;
+		return -ENOMEM;
 
 	*h = (struct queue_handle) {
 		.tail = q->q,
@@ -47,8 +57,10 @@ static int handle_init(struct pll_queue *q, struct queue_handle **out)
 		.deq = { .peer = h },
 	};
 
-	if (pthread_setspecific(q->hndlk, h))
-		goto err;
+	if ((rc = pthread_setspecific(q->hndlk, h))) {
+		mem_free(&q->opts.allocator, h, sizeof (*h));
+		return -rc;
+	}
 
 	if (!q->hndl_ring) {
 		q->hndl_ring = h;
@@ -63,59 +75,135 @@ static int handle_init(struct pll_queue *q, struct queue_handle **out)
 	if (out)
 		*out = h;
 	return 0;
-err:
-	if (h)
-		free(h);
-	return -errno;
+}
+
+static int lanes_init(pll_queue q)
+{
+	if (q->opts.lanes <= 1)
+		return 0;
+	if (q->opts.lanes > PLL_QUEUE_MAX_LANES)
+		return -EINVAL;
+
+	size_t n = q->opts.lanes - 1;
+	q->lanes = mem_alloc(&q->opts.allocator, sizeof (*q->lanes) * n);
+	if (!q->lanes)
+		return -ENOMEM;
+
+	struct pll_queue_opts opts = q->opts;
+	opts.lanes = 0;
+	for (size_t k = 0; k < n; ++k) {
+		if (!(q->lanes[k] = pll_queue_init_opts(&opts))) {
+			int rc = errno;
+			while (k > 0)
+				pll_queue_term(q->lanes[--k]);
+			mem_free(&q->opts.allocator, q->lanes, sizeof (*q->lanes) * n);
+			q->lanes = NULL;
+			return -rc;
+		}
+	}
+	return 0;
+}
+
+static void lanes_term(pll_queue q)
+{
+	if (!q->lanes)
+		return;
+	for (size_t k = 0; k < q->opts.lanes - 1; ++k)
+		pll_queue_term(q->lanes[k]);
+	mem_free(&q->opts.allocator, q->lanes,
+	         sizeof (*q->lanes) * (q->opts.lanes - 1));
 }
 
 pll_queue pll_queue_init(void)
 {
+	return pll_queue_init_opts(NULL);
+}
+
+pll_queue pll_queue_init_opts(const struct pll_queue_opts *opts)
+{
+	static const struct pll_queue_opts default_opts;
 	int rc = 0;
 
-	pll_queue queue = malloc(sizeof (*queue));
-	if (!queue)
-		goto err;
+	if (!opts)
+		opts = &default_opts;
+	if ((rc = -queue_alloc_check(opts))) {
+		errno = rc;
+		return NULL;
+	}
+
+	pll_queue queue = mem_alloc(&opts->allocator, sizeof (*queue));
+	if (!queue) {
+		errno = ENOMEM;
+		return NULL;
+	}
 
 	pthread_key_t key;
 	if ((rc = pthread_key_create(&key, NULL)))
-		goto err;
+		goto err_key;
 
 	*queue = (struct pll_queue) {
-		.q = new_segment(0),
 		.hndlk = key,
+		.opts = *opts,
+		.waitq = { .lock = PTHREAD_MUTEX_INITIALIZER },
 	};
 
-	if (handle_init(queue, NULL) < 0)
-		goto err;
+	if ((rc = -queue_alloc_init(queue)))
+		goto err_init;
 
-	return queue;
+	if ((rc = -lanes_init(queue)))
+		goto err_lanes;
 
-err:
-	if (queue) {
-		free(queue->q);
-		free(queue);
+	if (!(queue->q = new_segment(queue, 0))) {
+		rc = ENOMEM;
+		goto err_alloc;
 	}
-	if (rc)
-		pthread_key_delete(key);
+	queue->first = queue->q;
+	queue->nsegs = 1;
+
+	if ((rc = -handle_init(queue, NULL)))
+		goto err_handle;
+
+	return queue;
+
+err_handle:
+	segment_free(queue, queue->q);
+err_alloc:
+	lanes_term(queue);
+err_lanes:
+	queue_alloc_term(queue);
+err_init:
+	pthread_key_delete(key);
+err_key:
+	mem_free(&opts->allocator, queue, sizeof (*queue));
+	errno = rc;
 	return NULL;
 }
 
 void pll_queue_term(pll_queue q)
 {
+	struct pll_allocator a = q->opts.allocator;
+
 	for (struct queue_handle *h = q->hndl_ring->next; h != q->hndl_ring; ) {
 		struct queue_handle *next = h->next;
-		free(h);
+		if (h->spare)
+			segment_free(q, h->spare);
+		mem_free(&a, h, sizeof (*h));
 		h = next;
 	}
-	free(q->hndl_ring);
-	for (struct queue_segment *s = q->q; s; ) {
+	if (q->hndl_ring->spare)
+		segment_free(q, q->hndl_ring->spare);
+	mem_free(&a, q->hndl_ring, sizeof (*q->hndl_ring));
+	/* Retired segments keep their links, q is only the oldest live one */
+	for (struct queue_segment *s = q->first; s; ) {
 		struct queue_segment *next = s->next;
-		free(s);
+		segment_free(q, s);
 		s = next;
 	}
+	lanes_term(q);
+	queue_alloc_term(q);
+	pthread_mutex_destroy(&q->waitq.lock);
 	pthread_key_delete(q->hndlk);
-	free(q);
+	mem_free(&a, q, sizeof (*q));
 }
 
 static struct queue_handle *get_handle(pll_queue q)
@@ -141,7 +229,8 @@ static void enq_commit(pll_queue q, struct queue_cell *cell, void *val,
 	pll_aset(cell->val, val);
 }
 
-static void *find_cell(struct queue_segment **sp, uint64_t cell_id)
+static void *find_cell(pll_queue q, struct queue_handle *h,
+                       struct queue_segment **sp, uint64_t cell_id)
 {
 	/* Invariant: sp points to a valid segment*/
 	struct queue_segment *seg = *sp;
@@ -155,10 +244,28 @@ static void *find_cell(struct queue_segment **sp, uint64_t cell_id)
 			 * The list needs another segment. Allocate one and try to extend
 			 * the list.
 			 */
-			struct queue_segment *tmp = new_segment(i + 1);
-
-			if (!pll_cas(&seg->next, NULL, tmp))
-				free(tmp);
+			struct queue_segment *tmp = h->spare;
+			if (tmp) {
+				/* Lost an earlier race, so it was never published */
+				h->spare = NULL;
+				tmp->id = i + 1;
+			} else if (!(tmp = new_segment(q, i + 1))) {
+				abort();
+			}
+
+			if (pll_cas(&seg->next, NULL, tmp)) {
+				PLL_PROBE2(segment_alloc, q, i + 1);
+				pll_faa(&q->nsegs, 1);
+				if (q->opts.spill_dir)
+					spill_balance(q);
+			} else {
+				/*
+				 * Keep it for our next boundary: carved segments cannot be
+				 * given back to their chunk.
+				 */
+				PLL_PROBE2(segment_free, q, i + 1);
+				h->spare = tmp;
+			}
 			/* Invariant: a successor segment exists. */
 			next = seg->next;
 		}
@@ -189,13 +296,15 @@ static void enq_slow(pll_queue q, struct queue_handle *h, void *val,
 	 */
 	struct queue_segment *tmp_tail = h->tail;
 
+	PLL_PROBE2(enq_slow_entry, q, cell_id);
+
 	req->val = val;
 	req->state = (union queue_reqstate) { .s.pending = 1, .s.id = cell_id };
 
 	do {
 		/* Obtain a new cell index and locate candidate cell */
 		uint64_t i = pll_faa(&q->tail, 1);
-		struct queue_cell *cell = find_cell(&tmp_tail, i);
+		struct queue_cell *cell = find_cell(q, h, &tmp_tail, i);
 
 		/* Dijkstra's protocol */
 		if (pll_cas(&cell->enq, ENQUEUE_BOTTOM, req)
@@ -207,9 +316,10 @@ static void enq_slow(pll_queue q, struct queue_handle *h, void *val,
 	} while (req->state.s.pending);
 	/* Invariant: req claimed for a cell and find that cell */
 	uint64_t id = req->state.s.id;
-	struct queue_cell *cell = find_cell(&h->tail, id);
+	struct queue_cell *cell = find_cell(q, h, &h->tail, id);
 
 	enq_commit(q, cell, val, id);
+	PLL_PROBE2(enq_slow_exit, q, id);
 }
 
 static inline bool enq_fast(pll_queue q, struct queue_handle *h, void *val,
@@ -217,7 +327,7 @@ static inline bool enq_fast(pll_queue q, struct queue_handle *h, void *val,
 {
 	/* Obtain cell index and locate candidate cell */
 	uint64_t i = pll_faa(&q->tail, 1);
-	struct queue_cell *cell = find_cell(&h->tail, i);
+	struct queue_cell *cell = find_cell(q, h, &h->tail, i);
 
 	if (pll_cas(&cell->val, QUEUE_BOTTOM, val))
 		return true;
@@ -226,20 +336,45 @@ static inline bool enq_fast(pll_queue q, struct queue_handle *h, void *val,
 	return false;
 }
 
-void pll_enqueue(pll_queue q, void *val)
+static void enqueue(pll_queue q, struct queue_handle *h, void *val)
 {
 	uint64_t cell_id;
-	struct queue_handle *h = get_handle(q);
+
+	bool done = false;
 
 	pll_aset(h->hzdp, h->tail);
-	for (int p = PATIENCE; p >= 0; --p)
-		if (enq_fast(q, h, val, &cell_id))
-			return;
+	for (int p = PATIENCE; p >= 0 && !done; --p)
+		done = enq_fast(q, h, val, &cell_id);
 	/* Use id from last attempt */
-	enq_slow(q, h, val, cell_id);
+	if (!done)
+		enq_slow(q, h, val, cell_id);
+	/* Even on the fast path, or an idle producer pins every later segment */
 	pll_aset(h->hzdp, NULL);
 }
 
+void pll_enqueue(pll_queue q, void *val)
+{
+	enqueue(q, get_handle(q), val);
+	/* The value was published with a full barrier, see waitq_add() */
+	if (pll_load(&q->waitq.count))
+		waitq_wake(&q->waitq);
+}
+
+void pll_enqueue_prio(pll_queue q, void *val, unsigned prio)
+{
+	if (!prio || !q->lanes) {
+		pll_enqueue(q, val);
+		return;
+	}
+	if (prio >= q->opts.lanes)
+		prio = q->opts.lanes - 1;
+
+	pll_enqueue(q->lanes[prio - 1], val);
+	/* Waiters park on the queue, not on its lanes */
+	if (pll_load(&q->waitq.count))
+		waitq_wake(&q->waitq);
+}
+
 static void verify(struct queue_segment **seg, struct queue_segment *hzdp)
 {
 	if (hzdp && hzdp->id < (*seg)->id)
@@ -277,43 +412,66 @@ static void cleanup(pll_queue q, struct queue_handle *h)
 
 	struct queue_segment *s = q->q;
 
+	PLL_PROBE3(cleanup_start, q, i, e->id);
+
 	size_t numhds = 1024;
-	struct queue_handle **hds = malloc(sizeof (*hds) * numhds);
+	struct queue_handle **hds = mem_alloc(&q->opts.allocator,
+	                                      sizeof (*hds) * numhds);
+	/* Cleaning is best effort: give the claim back and retry another time */
 	if (!hds)
-		abort();
+		goto err_alloc;
 
+	/* Start with our own handle, its tail may lag far behind its head */
 	size_t j = 0;
-	for (struct queue_handle *p = h->next; p != h && e->id > i; p = p->next) {
+	struct queue_handle *p = h;
+	do {
 		verify(&e, p->hzdp);
 		update(&p->head, &e, p);
 		update(&p->tail, &e, p);
 		if (j >= numhds) {
+			struct queue_handle **tmp = mem_alloc(&q->opts.allocator,
+			                                      sizeof (*hds) * numhds * 2);
+			if (!tmp) {
+				mem_free(&q->opts.allocator, hds, sizeof (*hds) * numhds);
+				goto err_alloc;
+			}
+			memcpy(tmp, hds, sizeof (*hds) * numhds);
+			mem_free(&q->opts.allocator, hds, sizeof (*hds) * numhds);
+			hds = tmp;
 			numhds *= 2;
-			hds = realloc(hds, sizeof (*hds) * numhds);
-			if (!hds)
-				abort();
 		}
 		hds[j++] = p;
-	}
+		p = p->next;
+	} while (p != h && e->id > i);
 	while (e->id > i && j > 0)
 		verify(&e, hds[--j]->hzdp);
-	free(hds);
+	mem_free(&q->opts.allocator, hds, sizeof (*hds) * numhds);
 
 	if (e->id <= i) {
+		/* Nothing to retire this time, let a later run try again */
 		pll_aset(q->q, s);
+		pll_aset(q->oldseg, i);
+		PLL_PROBE3(cleanup_finish, q, i, i);
 		return;
 	}
 	pll_aset(q->q, e);
 	pll_aset(q->oldseg, e->id);
+	PLL_PROBE3(cleanup_finish, q, i, e->id);
 
 	// TODO: Check for correctness
 #if 0
 	for (struct queue_segment *seg = s; seg != e;) {
 		struct queue_segment *next = seg->next;
-		free(seg);
+		segment_free(q, seg);
 		seg = next;
 	}
 #endif
+	return;
+
+err_alloc:
+	/* Handles moved so far only point to live segments: nothing to undo */
+	pll_aset(q->oldseg, i);
+	PLL_PROBE3(cleanup_finish, q, i, i);
 }
 
 static void *help_enq(pll_queue q, struct queue_handle *h,
@@ -393,6 +551,7 @@ static void *help_enq(pll_queue q, struct queue_handle *h,
 	} else if (try_to_claim_req(&req->state.u64, state.s.id, i)
 				|| (state.u64 == s_val.u64 && cell->val == QUEUE_TOP)) {
 		/* Someone claimed this request; not committed */
+		PLL_PROBE3(help_enq, q, (uint64_t)state.s.id, i);
 		enq_commit(q, cell, val, i);
 	}
 
@@ -404,7 +563,7 @@ static void *deq_fast(pll_queue q, struct queue_handle *h, uint64_t *cell_id)
 {
 	/* Obtain cell index and locate candidate cell */
 	uint64_t i = pll_faa(&q->head, 1);
-	struct queue_cell *cell = find_cell(&h->head, i);
+	struct queue_cell *cell = find_cell(q, h, &h->head, i);
 	void *val = help_enq(q, h, cell, i);
 
 	if (val == QUEUE_EMPTY)
@@ -431,6 +590,9 @@ static void help_deq(pll_queue q, struct queue_handle *h,
 	if (!state.s.pending || state.s.id < id)
 		return;
 
+	if (h != h_help)
+		PLL_PROBE2(help_deq, q, id);
+
 	/* head: a local segment pointer for announced cells */
 	struct queue_segment *head = h_help->head;
 
@@ -455,7 +617,7 @@ static void help_deq(pll_queue q, struct queue_handle *h,
 		 */
 		for (struct queue_segment *c_seg = head;
 				!cand && state.s.id == prior;) {
-			cell = find_cell(&c_seg, ++i);
+			cell = find_cell(q, h, &c_seg, ++i);
 
 			void *val = help_enq(q, h, cell, i);
 
@@ -488,7 +650,7 @@ static void help_deq(pll_queue q, struct queue_handle *h,
 			return;
 
 		/* Find the announced candidate */
-		cell = find_cell(&head, state.s.id);
+		cell = find_cell(q, h, &head, state.s.id);
 
 		/*
 		 * If candidate permits returning QUEUE_EMPTY (cell->val == QUEUE_TOP)
@@ -521,6 +683,8 @@ static void *deq_slow(pll_queue q, struct queue_handle *h, uint64_t cell_id)
 {
 	struct queue_deqreq *req = &h->deq.req;
 
+	PLL_PROBE2(deq_slow_entry, q, cell_id);
+
 	/* Publish dequeue request */
 	pll_aset(req->id, cell_id);
 
@@ -531,17 +695,17 @@ static void *deq_slow(pll_queue q, struct queue_handle *h, uint64_t cell_id)
 
 	/* Find the destination cell & read its value */
 	uint64_t i = req->state.s.id;
-	struct queue_cell *cell = find_cell(&h->head, i);
+	struct queue_cell *cell = find_cell(q, h, &h->head, i);
 	void *val = cell->val;
 
 	advance_end_for_linearizability(&q->head, i + 1);
 
+	PLL_PROBE3(deq_slow_exit, q, i, val == QUEUE_TOP);
 	return (val == QUEUE_TOP ? QUEUE_EMPTY : val);
 }
 
-void *pll_dequeue(pll_queue q)
+static void *dequeue(pll_queue q, struct queue_handle *h)
 {
-	struct queue_handle *h = get_handle(q);
 	pll_aset(h->hzdp, h->head);
 
 	void *val = NULL;
@@ -563,10 +727,83 @@ void *pll_dequeue(pll_queue q)
 
 	pll_aset(h->hzdp, NULL);
 	cleanup(q, h);
+	if (q->opts.spill_dir)
+		spill_balance(q);
 	return val;
 }
 
+static uint64_t lane_size(pll_queue q)
+{
+	/* Head first: racing enqueues may only make the estimate larger */
+	uint64_t head = pll_load(&q->head);
+	uint64_t tail = pll_load(&q->tail);
+
+	return tail > head ? tail - head : 0;
+}
+
+static void *lanes_dequeue(pll_queue q)
+{
+	if (!q->lanes)
+		return QUEUE_EMPTY;
+
+	for (size_t k = q->opts.lanes - 1; k > 0; --k) {
+		pll_queue lane = q->lanes[k - 1];
+
+		/* Do not burn a cell in every empty lane on the way down */
+		if (!lane_size(lane))
+			continue;
+
+		void *val = pll_dequeue(lane);
+		if (val != QUEUE_EMPTY)
+			return val;
+	}
+	return QUEUE_EMPTY;
+}
+
+void *pll_dequeue(pll_queue q)
+{
+	void *val = lanes_dequeue(q);
+
+	if (val != QUEUE_EMPTY)
+		return val;
+	return dequeue(q, get_handle(q));
+}
+
+size_t pll_dequeue_batch(pll_queue q, void **vals, size_t n)
+{
+	struct queue_handle *h = get_handle(q);
+	size_t i = 0;
+
+	while (i < n && !pll_queue_empty(q)) {
+		void *val = lanes_dequeue(q);
+		if (val == QUEUE_EMPTY && lane_size(q))
+			val = dequeue(q, h);
+		if (val == QUEUE_EMPTY)
+			break;
+		vals[i++] = val;
+	}
+	return i;
+}
+
 bool pll_queue_empty(pll_queue q)
 {
-	return q->head == q->tail;
+	return pll_queue_size_approx(q) == 0;
+}
+
+size_t pll_queue_size_approx(pll_queue q)
+{
+	size_t size = lane_size(q);
+
+	for (size_t k = 0; q->lanes && k < q->opts.lanes - 1; ++k)
+		size += lane_size(q->lanes[k]);
+	return size;
+}
+
+size_t pll_queue_segments(pll_queue q)
+{
+	size_t segs = pll_load(&q->nsegs);
+
+	for (size_t k = 0; q->lanes && k < q->opts.lanes - 1; ++k)
+		segs += pll_load(&q->lanes[k]->nsegs);
+	return segs;
 }
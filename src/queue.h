@@ -1,8 +1,11 @@
 #ifndef _PLL_QUEUE_H
 #define _PLL_QUEUE_H
 
+#include <pthread.h>
 #include <stdint.h>
 
+#include "paralull.h"
+
 #define CELLS_NUMBER	4096
 
 
@@ -36,13 +39,47 @@ struct queue_segment {
 	struct queue_cell cells[CELLS_NUMBER];
 };
 
+/* Consumers parked in pll_dequeue_any() */
+struct queue_waitq {
+	uint64_t count;
+	pthread_mutex_t lock;
+	struct queue_waitlink *first;
+};
+
+/* Paging state of a queue whose segments live in a spill file */
+struct queue_spill {
+	int fd;
+	uint64_t size;
+	uint64_t busy;
+	uint64_t head_seen, tail_seen, front_seen;
+	/* oldest cold segment still in memory */
+	struct queue_segment *evict;
+	uint64_t prefetched;
+	/* threads in chunk_carve(), which may still look at an unlinked chunk */
+	uint64_t carvers;
+	/* chunk of the last released segment, drained chunks to unmap */
+	struct queue_chunk *last, *dead;
+};
+
 struct pll_queue {
 	struct queue_segment *q;
+	/*
+	 * Oldest segment still allocated: cleanup() retires segments by moving q
+	 * but never frees them, spill mode releases them from here.
+	 */
+	struct queue_segment *first;
 	uint64_t tail;
 	uint64_t head;
 	int64_t oldseg;
 	struct queue_handle *hndl_ring;
 	pthread_key_t hndlk;
+	struct pll_queue_opts opts;
+	struct queue_chunk *chunks;
+	uint64_t nsegs;
+	struct queue_waitq waitq;
+	struct queue_spill spill;
+	/* priority lanes, lanes[k - 1] holds level k, level 0 is this queue */
+	struct pll_queue **lanes;
 };
 
 struct queue_enqueue {
@@ -61,6 +98,8 @@ struct queue_handle {
 	struct queue_enqueue enq;
 	struct queue_dequeue deq;
 	struct queue_segment *hzdp;
+	/* segment that lost the race to extend the list, reused next time */
+	struct queue_segment *spare;
 };
 
 #endif /* _PLL_QUEUE_H */
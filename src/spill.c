@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "atomic.h"
+#include "queue.h"
+#include "spill.h"
+
+#define DEFAULT_RESIDENT 64
+
+size_t spill_stride(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (sizeof (struct queue_segment) + page - 1) / page * page;
+}
+
+int spill_open(struct pll_queue *q)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof (path), "%s/paralull-spill-XXXXXX",
+	             q->opts.spill_dir) >= (int)sizeof (path))
+		return -ENAMETOOLONG;
+
+	int fd = mkostemp(path, O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	/* Nobody else needs to find it, and it goes away with the last mapping */
+	unlink(path);
+
+	q->spill.fd = fd;
+	return 0;
+}
+
+void spill_close(struct pll_queue *q)
+{
+	/* Drained chunks still in q->chunks are unmapped with the others */
+	for (struct queue_chunk *c = q->spill.dead; c; ) {
+		struct queue_chunk *next = c->dead;
+		if (c->unlinked)
+			munmap(c, c->size);
+		c = next;
+	}
+	close(q->spill.fd);
+}
+
+void *spill_map(struct pll_queue *q, size_t size, uint64_t *off)
+{
+	*off = pll_faa(&q->spill.size, size);
+
+	/* Reserve the blocks now rather than SIGBUS on a full disk later */
+	if (posix_fallocate(q->spill.fd, *off, size))
+		return NULL;
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                 q->spill.fd, *off);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void page_out(struct queue_segment *seg)
+{
+	/*
+	 * The mapping is shared with the file, so dropping the pages only writes
+	 * them back: a late access faults the cells in again.
+	 */
+#ifdef MADV_PAGEOUT
+	if (!madvise(seg, spill_stride(), MADV_PAGEOUT))
+		return;
+#endif
+	madvise(seg, spill_stride(), MADV_DONTNEED);
+}
+
+void spill_unmap(struct pll_queue *q, struct queue_chunk *c)
+{
+	/* The header is in the hole too: read it first */
+	uint64_t off = c->off;
+	size_t size = c->size;
+
+	/* Whatever the chunk still holds in the file goes away with it */
+	fallocate(q->spill.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	          off, size);
+	munmap(c, size);
+}
+
+static bool chunk_holds(struct queue_chunk *c, struct queue_segment *seg)
+{
+	return (char *)seg >= (char *)c && (char *)seg < (char *)c + c->size;
+}
+
+static void release(struct pll_queue *q, struct queue_segment *seg)
+{
+	struct queue_spill *sp = &q->spill;
+	struct queue_chunk *c = sp->last;
+
+	/* Segments mostly retire in the order they were carved */
+	if (!c || !chunk_holds(c, seg))
+		for (c = q->chunks; !chunk_holds(c, seg); c = c->next)
+			;
+	sp->last = c;
+
+	/*
+	 * Give the blocks back to the file system and drop the pages with them,
+	 * so the file only holds the backlog and not everything that went
+	 * through the queue.
+	 */
+	if (fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	              c->off + ((char *)seg - (char *)c), spill_stride()))
+		page_out(seg);
+
+	if (++c->released == SPILL_CHUNK_SEGMENTS) {
+		c->dead = sp->dead;
+		sp->dead = c;
+	}
+}
+
+/* Unmaps the chunks whose segments were all released */
+static void reap(struct pll_queue *q)
+{
+	struct queue_spill *sp = &q->spill;
+	struct queue_chunk *head = pll_load(&q->chunks);
+
+	/*
+	 * Carvers only ever look at the head, and only the head changes under
+	 * our feet: the rest of the list is ours to unlink from.
+	 */
+	for (struct queue_chunk *c = sp->dead; c; c = c->dead) {
+		if (c->unlinked || c == head)
+			continue;
+
+		struct queue_chunk *p = head;
+		while (p->next != c)
+			p = p->next;
+		p->next = c->next;
+		c->unlinked = true;
+	}
+
+	/* A carver may still hold one of them from back when it was the head */
+	pll_barrier();
+	if (pll_load(&sp->carvers))
+		return;
+
+	for (struct queue_chunk **dp = &sp->dead; *dp; ) {
+		struct queue_chunk *c = *dp;
+
+		if (!c->unlinked) {
+			dp = &c->dead;
+			continue;
+		}
+		*dp = c->dead;
+		if (sp->last == c)
+			sp->last = NULL;
+		spill_unmap(q, c);
+	}
+}
+
+void spill_balance(struct pll_queue *q)
+{
+	struct queue_spill *sp = &q->spill;
+	uint64_t head = pll_load(&q->head) / CELLS_NUMBER;
+	uint64_t tail = pll_load(&q->tail) / CELLS_NUMBER;
+
+	struct queue_segment *front = pll_load(&q->q);
+
+	/* Nothing to do until head, tail or cleanup() moves to another segment */
+	if (head == pll_load(&sp->head_seen) && tail == pll_load(&sp->tail_seen)
+			&& front->id == pll_load(&sp->front_seen))
+		return;
+	if (!pll_cas(&sp->busy, 0, 1))
+		return;
+	pll_aset(sp->head_seen, head);
+	pll_aset(sp->tail_seen, tail);
+	pll_aset(sp->front_seen, front->id);
+
+	uint64_t resident = q->opts.spill_resident
+		? q->opts.spill_resident : DEFAULT_RESIDENT;
+	/* Windows kept in memory ahead of head and behind tail */
+	uint64_t ahead = resident / 4 ? resident / 4 : 1;
+	uint64_t behind = resident / 2 ? resident / 2 : 1;
+
+	if (!sp->evict)
+		sp->evict = q->first;
+
+	/*
+	 * Segments retired by cleanup(): no handle can reach them any more. Read
+	 * the link first, the hole reads back as zeroes.
+	 */
+	while (q->first->id < front->id) {
+		struct queue_segment *next = q->first->next;
+
+		if (sp->evict == q->first)
+			sp->evict = next;
+		release(q, q->first);
+		q->first = next;
+	}
+	if (sp->dead)
+		reap(q);
+
+	/*
+	 * Cold segments: neither about to be dequeued nor still being filled.
+	 * Consumed ones stay in memory until cleanup() retires them.
+	 */
+	while (sp->evict->id + behind < tail && sp->evict->next) {
+		if (sp->evict->id >= head + ahead)
+			page_out(sp->evict);
+		sp->evict = sp->evict->next;
+	}
+
+	/* Read back ahead of head what the previous rounds paged out */
+	uint64_t from = sp->prefetched > head ? sp->prefetched : head;
+	for (struct queue_segment *s = q->first; s && s->id < head + ahead;
+			s = s->next)
+		if (s->id >= from)
+			madvise(s, spill_stride(), MADV_WILLNEED);
+	if (sp->prefetched < head + ahead)
+		sp->prefetched = head + ahead;
+
+	pll_aset(sp->busy, 0);
+}
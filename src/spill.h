@@ -0,0 +1,20 @@
+#ifndef _PLL_SPILL_H
+#define _PLL_SPILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+#include "queue.h"
+
+/* Segments mapped at once from the spill file */
+#define SPILL_CHUNK_SEGMENTS 64
+
+size_t spill_stride(void);
+int spill_open(struct pll_queue *q);
+void spill_close(struct pll_queue *q);
+void *spill_map(struct pll_queue *q, size_t size, uint64_t *off);
+void spill_unmap(struct pll_queue *q, struct queue_chunk *c);
+void spill_balance(struct pll_queue *q);
+
+#endif /* _PLL_SPILL_H */
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "atomic.h"
+#include "paralull.h"
+#include "queue.h"
+#include "wait.h"
+
+void waitq_add(struct queue_waitq *wq, struct queue_waitlink *link)
+{
+	/*
+	 * Count first: the caller checks the queue again afterwards, so either
+	 * an enqueuer sees the count or the caller sees its item.
+	 */
+	pll_faa(&wq->count, 1);
+
+	pthread_mutex_lock(&wq->lock);
+	link->prev = NULL;
+	link->next = wq->first;
+	if (wq->first)
+		wq->first->prev = link;
+	wq->first = link;
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void waitq_remove(struct queue_waitq *wq, struct queue_waitlink *link)
+{
+	pthread_mutex_lock(&wq->lock);
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		wq->first = link->next;
+	if (link->next)
+		link->next->prev = link->prev;
+	pthread_mutex_unlock(&wq->lock);
+
+	pll_fas(&wq->count, 1);
+}
+
+void waitq_wake(struct queue_waitq *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	for (struct queue_waitlink *l = wq->first; l; l = l->next) {
+		struct queue_waiter *w = l->waiter;
+
+		pthread_mutex_lock(&w->lock);
+		w->signaled = true;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+}
+
+static void *poll_any(pll_queue *queues, size_t n, size_t start,
+                      size_t *index)
+{
+	for (size_t k = 0; k < n; ++k) {
+		size_t i = (start + k) % n;
+
+		/* Skip empty queues rather than burning a cell in each */
+		if (pll_queue_empty(queues[i]))
+			continue;
+
+		void *val = pll_dequeue(queues[i]);
+		if (val != PLL_QUEUE_EMPTY) {
+			*index = i;
+			return val;
+		}
+	}
+	return PLL_QUEUE_EMPTY;
+}
+
+static bool any_ready(pll_queue *queues, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		if (!pll_queue_empty(queues[i]))
+			return true;
+	return false;
+}
+
+/* Returns false once the deadline has passed */
+static bool park(struct queue_waiter *w, const struct timespec *deadline)
+{
+	bool timedout = false;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->signaled && !timedout) {
+		if (deadline)
+			timedout = pthread_cond_timedwait(&w->cond, &w->lock,
+			                                  deadline) == ETIMEDOUT;
+		else
+			pthread_cond_wait(&w->cond, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return !timedout;
+}
+
+void *pll_dequeue_any(pll_queue *queues, size_t n, long timeout_ms,
+                      size_t *index, enum pll_any_fairness fairness)
+{
+	if (!n)
+		return PLL_QUEUE_EMPTY;
+
+	size_t start = fairness == PLL_ANY_ROTATE ? (*index + 1) % n : 0;
+	void *val = poll_any(queues, n, start, index);
+	if (val != PLL_QUEUE_EMPTY || timeout_ms == 0)
+		return val;
+
+	struct timespec deadline;
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	const struct pll_allocator *a = &queues[0]->opts.allocator;
+	struct queue_waitlink stack_links[PLL_ANY_STACK_QUEUES];
+	struct queue_waitlink *links = stack_links;
+
+	if (n > PLL_ANY_STACK_QUEUES
+			&& !(links = mem_alloc(a, sizeof (*links) * n))) {
+		errno = ENOMEM;
+		return PLL_QUEUE_EMPTY;
+	}
+
+	struct queue_waiter w = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	bool alive = true;
+	while (alive) {
+		w.signaled = false;
+		for (size_t i = 0; i < n; ++i) {
+			links[i].waiter = &w;
+			waitq_add(&queues[i]->waitq, &links[i]);
+		}
+
+		if (!any_ready(queues, n))
+			alive = park(&w, timeout_ms > 0 ? &deadline : NULL);
+
+		for (size_t i = 0; i < n; ++i)
+			waitq_remove(&queues[i]->waitq, &links[i]);
+
+		/* One last look even when timing out */
+		val = poll_any(queues, n, start, index);
+		if (val != PLL_QUEUE_EMPTY)
+			break;
+	}
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	if (links != stack_links)
+		mem_free(a, links, sizeof (*links) * n);
+	return val;
+}
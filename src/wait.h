@@ -0,0 +1,25 @@
+#ifndef _PLL_WAIT_H
+#define _PLL_WAIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "queue.h"
+
+struct queue_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool signaled;
+};
+
+/* One per queue a waiter is registered on */
+struct queue_waitlink {
+	struct queue_waiter *waiter;
+	struct queue_waitlink *prev, *next;
+};
+
+void waitq_add(struct queue_waitq *wq, struct queue_waitlink *link);
+void waitq_remove(struct queue_waitq *wq, struct queue_waitlink *link);
+void waitq_wake(struct queue_waitq *wq);
+
+#endif /* _PLL_WAIT_H */
@@ -0,0 +1,86 @@
+#include <paralull.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <thread>
+
+#define NB_CONSUMERS 1000
+#define NB_ROUNDS 100
+
+#define check(Cond, Msg)                                    \
+  do {                                                      \
+    if (!(Cond)) {                                          \
+      std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, Msg); \
+      std::exit(1);                                         \
+    }                                                       \
+  } while (0)
+
+/* Fire-and-forget coroutine */
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::abort(); }
+  };
+};
+
+static std::atomic<uintptr_t> sum;
+static std::atomic<size_t> finished;
+
+static detached consumer(pll::co_queue<void>& q) {
+  for (size_t i = 0; i < NB_ROUNDS; ++i) {
+    void *val = co_await q.pop();
+    sum.fetch_add(reinterpret_cast<uintptr_t>(val));
+  }
+  finished.fetch_add(1);
+}
+
+static void run(pll_executor ex) {
+  pll::co_queue<void> q(ex);
+  const size_t items = NB_CONSUMERS * NB_ROUNDS;
+
+  sum = 0;
+  finished = 0;
+
+  /* Every consumer suspends: nothing was pushed yet */
+  for (size_t i = 0; i < NB_CONSUMERS; ++i)
+    consumer(q);
+  check(finished == 0, "Consumer did not suspend on an empty queue");
+
+  for (uintptr_t i = 1; i <= items; ++i)
+    q.push(reinterpret_cast<void *>(i));
+
+  while (finished != NB_CONSUMERS)
+    std::this_thread::yield();
+  check(sum == items * (items + 1) / 2, "Items were lost or duplicated");
+  void *val;
+  check(!q.try_pop(val), "Drained queue is not empty");
+}
+
+int main() {
+  /* Resumed inline by the producer */
+  run(nullptr);
+
+  /* Resumed on an executor */
+  struct pll_executor_opts opts = {};
+  opts.workers = 4;
+  pll_executor ex = pll_executor_init(&opts);
+  check(ex, "Could not create executor");
+  run(ex);
+  pll_executor_term(ex);
+
+  pll::co_queue<void> q;
+  void *val = nullptr;
+  q.push(reinterpret_cast<void *>(42));
+  check(q.try_pop(val) && val == reinterpret_cast<void *>(42),
+        "try_pop missed an item");
+  /* nullptr is an item like any other */
+  q.push(nullptr);
+  check(q.try_pop(val) && val == nullptr, "try_pop missed a null item");
+  check(!q.try_pop(val), "try_pop returned a ghost item");
+  return 0;
+}
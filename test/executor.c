@@ -0,0 +1,97 @@
+#include <criterion/criterion.h>
+#include <paralull.h>
+#include <stddef.h>
+
+#define NB_WORKERS 4
+#define NB_TASKS 100000
+
+struct counted_task {
+    struct pll_task task;
+    size_t *counter;
+};
+
+static void counted_run(struct pll_task *task)
+{
+    struct counted_task *t = (struct counted_task *)
+        ((char *) task - offsetof(struct counted_task, task));
+    __sync_fetch_and_add(t->counter, 1);
+}
+
+static void run_all(bool steal, bool pin)
+{
+    static struct counted_task tasks[NB_TASKS];
+    size_t counter = 0;
+
+    struct pll_executor_opts opts = {
+        .workers = NB_WORKERS,
+        .steal = steal,
+        .pin = pin,
+    };
+    pll_executor ex = pll_executor_init(&opts);
+    cr_assert_not_null(ex, "Could not create executor");
+
+    for (size_t i = 0; i < NB_TASKS; ++i) {
+        tasks[i] = (struct counted_task) {
+            .task = { .run = counted_run },
+            .counter = &counter,
+        };
+        pll_executor_submit(ex, &tasks[i].task);
+    }
+
+    /* Termination drains the run-queue(s) */
+    pll_executor_term(ex);
+    cr_assert_eq(counter, NB_TASKS, "Only %zu tasks ran", counter);
+}
+
+Test(executor, shared_queue, .timeout = 10)
+{
+    run_all(false, false);
+}
+
+Test(executor, stealing, .timeout = 10)
+{
+    run_all(true, false);
+}
+
+/* More workers than allowed CPUs, try under taskset with a partial mask too */
+Test(executor, pinned, .timeout = 10)
+{
+    run_all(false, true);
+}
+
+struct spawning_task {
+    struct pll_task task;
+    pll_executor ex;
+    size_t depth;
+    size_t *counter;
+};
+
+static void spawning_run(struct pll_task *task)
+{
+    struct spawning_task *t = (struct spawning_task *)
+        ((char *) task - offsetof(struct spawning_task, task));
+
+    __sync_fetch_and_add(t->counter, 1);
+    if (t->depth) {
+        --t->depth;
+        pll_executor_submit(t->ex, &t->task);
+    }
+}
+
+Test(executor, nested_submit, .timeout = 10)
+{
+    size_t counter = 0;
+    struct pll_executor_opts opts = { .workers = 2, .steal = true };
+    pll_executor ex = pll_executor_init(&opts);
+
+    struct spawning_task t = {
+        .task = { .run = spawning_run },
+        .ex = ex,
+        .depth = 1000,
+        .counter = &counter,
+    };
+    pll_executor_submit(ex, &t.task);
+
+    pll_executor_term(ex);
+    cr_assert_eq(counter, 1001, "Tasks submitted by tasks did not run");
+}
@@ -0,0 +1,98 @@
+#include <criterion/criterion.h>
+#include <paralull.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define NB_SHARDS 4
+#define NB_PRODUCERS 4
+#define NB_CONSUMERS 4
+#define NB_ITEMS 200000
+
+Test(mqueue, lifecycle)
+{
+    pll_mqueue mq = pll_mqueue_init(NB_SHARDS, NULL);
+    cr_assert_not_null(mq, "Could not create sharded queue");
+    cr_assert_eq(pll_mqueue_dequeue(mq), PLL_QUEUE_EMPTY, "New queue is not empty");
+    pll_mqueue_term(mq);
+
+    cr_assert_null(pll_mqueue_init(0, NULL), "Queue without shards was accepted");
+}
+
+Test(mqueue, steal)
+{
+    pll_mqueue mq = pll_mqueue_init(NB_SHARDS, NULL);
+
+    for (size_t i = 0; i < NB_SHARDS; ++i) {
+        cr_assert_eq(pll_mqueue_bind(mq, i), 0, "Could not bind home shard");
+        pll_mqueue_enqueue(mq, (void *) (i + 1));
+    }
+    cr_assert_eq(pll_mqueue_size_approx(mq), NB_SHARDS, "Wrong size");
+
+    /* Every shard is reachable from any home shard */
+    pll_mqueue_bind(mq, 0);
+    for (size_t i = 0; i < NB_SHARDS; ++i)
+        cr_assert_neq(pll_mqueue_dequeue(mq), PLL_QUEUE_EMPTY, "Item was not stolen");
+    cr_assert_eq(pll_mqueue_dequeue(mq), PLL_QUEUE_EMPTY, "Drained queue is not empty");
+
+    pll_mqueue_term(mq);
+}
+
+static volatile size_t remaining;
+static volatile size_t disorders;
+
+static void *producer(void *ctx)
+{
+    pll_mqueue mq = ctx;
+    static volatile uintptr_t ids;
+    uintptr_t id = __sync_fetch_and_add(&ids, 1);
+
+    /* Producer id in the upper bits, sequence number in the lower ones */
+    for (uintptr_t i = 1; i <= NB_ITEMS; ++i)
+        pll_mqueue_enqueue(mq, (void *) (id << 32 | i));
+    return NULL;
+}
+
+static void *consumer(void *ctx)
+{
+    pll_mqueue mq = ctx;
+    uintptr_t last[NB_PRODUCERS] = { 0 };
+
+    while (remaining) {
+        void *val = pll_mqueue_dequeue(mq);
+        if (val == PLL_QUEUE_EMPTY)
+            continue;
+
+        uintptr_t id = (uintptr_t) val >> 32;
+        uintptr_t seq = (uintptr_t) val & 0xffffffff;
+        if (seq <= last[id])
+            __sync_fetch_and_add(&disorders, 1);
+        last[id] = seq;
+        __sync_fetch_and_sub(&remaining, 1);
+    }
+    return NULL;
+}
+
+Test(mqueue, per_producer_fifo, .timeout = 10)
+{
+    pll_mqueue mq = pll_mqueue_init(NB_SHARDS, NULL);
+    pthread_t threads[NB_PRODUCERS + NB_CONSUMERS];
+    int rc = 0;
+
+    remaining = (size_t) NB_PRODUCERS * NB_ITEMS;
+
+    size_t i = 0;
+    for (; i < NB_PRODUCERS; ++i)
+        rc |= pthread_create(&threads[i], NULL, producer, mq);
+    for (; i < NB_PRODUCERS + NB_CONSUMERS; ++i)
+        rc |= pthread_create(&threads[i], NULL, consumer, mq);
+    cr_assert(!rc, "Could not create worker threads");
+
+    for (i = 0; i < NB_PRODUCERS + NB_CONSUMERS; ++i)
+        rc |= pthread_join(threads[i], NULL);
+    cr_assert(!rc, "Could not join all worker threads");
+
+    cr_assert_eq(disorders, 0, "Per-producer ordering was not respected");
+    cr_assert_eq(pll_mqueue_size_approx(mq), 0, "Resulting queue is not empty");
+
+    pll_mqueue_term(mq);
+}
@@ -1,4 +1,14 @@
+#define _GNU_SOURCE
 #include <criterion/criterion.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <paralull.h>
 
 Test(queue, lifecycle)
@@ -35,3 +45,391 @@ Test(queue, axiom_ordering)
 
     pll_queue_term(queue);
 }
+
+Test(queue, hugepages)
+{
+    struct pll_queue_opts opts = { .hugepages = true };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create hugepage-backed queue");
+
+    /* Span several 2 MB chunks worth of segments */
+    const size_t count = 100 * 4096;
+    for (size_t i = 1; i <= count; ++i)
+        pll_enqueue(queue, (void *) i);
+    for (size_t i = 1; i <= count; ++i)
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+
+    pll_queue_term(queue);
+}
+
+Test(queue, numa_bad_node)
+{
+    struct pll_queue_opts opts = {
+        .numa_policy = PLL_NUMA_BIND,
+        .numa_node = -1,
+    };
+    cr_assert_null(pll_queue_init_opts(&opts), "Invalid NUMA node was accepted");
+}
+
+struct counting_allocator {
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+};
+
+static void *counting_alloc(size_t size, void *ctx)
+{
+    struct counting_allocator *a = ctx;
+    __sync_fetch_and_add(&a->allocs, 1);
+    __sync_fetch_and_add(&a->bytes, size);
+    return malloc(size);
+}
+
+static void counting_free(void *ptr, size_t size, void *ctx)
+{
+    struct counting_allocator *a = ctx;
+    __sync_fetch_and_add(&a->frees, 1);
+    __sync_fetch_and_sub(&a->bytes, size);
+    free(ptr);
+}
+
+Test(queue, allocator)
+{
+    struct counting_allocator a = { 0 };
+    struct pll_queue_opts opts = {
+        .allocator = {
+            .alloc = counting_alloc,
+            .free = counting_free,
+            .ctx = &a,
+        },
+    };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create queue with a custom allocator");
+
+    /* Enough segments for cleanup() to retire some of them */
+    for (size_t i = 1; i <= 40 * 4096; ++i) {
+        pll_enqueue(queue, (void *) i);
+        pll_dequeue(queue);
+    }
+    cr_assert_gt(a.allocs, 40, "Segments did not go through the allocator");
+
+    pll_queue_term(queue);
+    cr_assert_eq(a.allocs, a.frees, "Leaked %zu allocations", a.allocs - a.frees);
+    cr_assert_eq(a.bytes, 0, "Leaked %zu bytes", a.bytes);
+}
+
+struct failing_allocator {
+    struct counting_allocator count;
+    size_t budget;
+};
+
+/* Fails once the budget is spent, and leaves errno alone like most hooks */
+static void *failing_alloc(size_t size, void *ctx)
+{
+    struct failing_allocator *a = ctx;
+    if (a->count.allocs == a->budget)
+        return NULL;
+    return counting_alloc(size, &a->count);
+}
+
+static void failing_free(void *ptr, size_t size, void *ctx)
+{
+    struct failing_allocator *a = ctx;
+    counting_free(ptr, size, &a->count);
+}
+
+Test(queue, allocator_failure)
+{
+    /* Queue, first segment, then the handle of the creating thread */
+    for (size_t budget = 0; budget < 3; ++budget) {
+        struct failing_allocator a = { .budget = budget };
+        struct pll_queue_opts opts = {
+            .allocator = {
+                .alloc = failing_alloc,
+                .free = failing_free,
+                .ctx = &a,
+            },
+        };
+        errno = 0;
+        cr_assert_null(pll_queue_init_opts(&opts), "Failed allocation was ignored");
+        cr_assert_eq(errno, ENOMEM, "Wrong errno after a failed allocation");
+        cr_assert_eq(a.count.bytes, 0, "Leaked %zu bytes", a.count.bytes);
+    }
+}
+
+Test(queue, allocator_failure_cleanup)
+{
+    struct failing_allocator a = { .budget = (size_t) -1 };
+    struct pll_queue_opts opts = {
+        .allocator = {
+            .alloc = failing_alloc,
+            .free = failing_free,
+            .ctx = &a,
+        },
+    };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create queue with a custom allocator");
+
+    /* Segments first, then nothing: dequeues only allocate to clean up */
+    for (size_t i = 1; i <= 40 * 4096; ++i)
+        pll_enqueue(queue, (void *) i);
+    a.budget = a.count.allocs;
+    for (size_t i = 1; i <= 40 * 4096; ++i)
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+    cr_assert(pll_queue_empty(queue), "Drained queue is not empty");
+
+    pll_queue_term(queue);
+    cr_assert_eq(a.count.bytes, 0, "Leaked %zu bytes", a.count.bytes);
+}
+
+Test(queue, allocator_exclusive)
+{
+    struct counting_allocator a = { 0 };
+    struct pll_queue_opts opts = {
+        .hugepages = true,
+        .allocator = {
+            .alloc = counting_alloc,
+            .free = counting_free,
+            .ctx = &a,
+        },
+    };
+    cr_assert_null(pll_queue_init_opts(&opts), "Conflicting options were accepted");
+}
+
+Test(queue, size_approx)
+{
+    pll_queue queue = pll_queue_init();
+    cr_assert_eq(pll_queue_size_approx(queue), 0, "New queue is not empty");
+
+    for (size_t i = 1; i <= 10; ++i)
+        pll_enqueue(queue, (void *) i);
+    cr_assert_eq(pll_queue_size_approx(queue), 10, "Wrong size after enqueues");
+
+    for (size_t i = 1; i <= 4; ++i)
+        pll_dequeue(queue);
+    cr_assert_eq(pll_queue_size_approx(queue), 6, "Wrong size after dequeues");
+
+    /* Dequeues on an empty queue push head past tail */
+    for (size_t i = 1; i <= 10; ++i)
+        pll_dequeue(queue);
+    cr_assert_eq(pll_queue_size_approx(queue), 0, "Overshot queue is not empty");
+    cr_assert(pll_queue_empty(queue), "Overshot queue is not empty");
+
+    pll_enqueue(queue, (void *) 1);
+    cr_assert_eq(pll_queue_size_approx(queue), 1, "Wrong size after overshoot");
+    cr_assert(!pll_queue_empty(queue), "1-element queue is empty");
+
+    pll_queue_term(queue);
+}
+
+Test(queue, segments)
+{
+    pll_queue queue = pll_queue_init();
+    cr_assert_eq(pll_queue_segments(queue), 1, "New queue has no segment");
+
+    for (size_t i = 0; i <= 2 * 4096; ++i)
+        pll_enqueue(queue, (void *) 1);
+    cr_assert_eq(pll_queue_segments(queue), 3, "Wrong number of segments");
+
+    pll_queue_term(queue);
+}
+
+static long status_kb(const char *field)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    while (f && fgets(line, sizeof (line), f))
+        if (!strncmp(line, field, strlen(field)))
+            kb = atol(line + strlen(field));
+    if (f)
+        fclose(f);
+    return kb;
+}
+
+/* Blocks allocated to the (unlinked) spill file created in dir */
+static long spill_file_kb(const char *dir)
+{
+    DIR *d = opendir("/proc/self/fd");
+    long kb = -1;
+
+    for (struct dirent *e; d && (e = readdir(d)); ) {
+        char link[PATH_MAX], target[PATH_MAX];
+        snprintf(link, sizeof (link), "/proc/self/fd/%s", e->d_name);
+        ssize_t n = readlink(link, target, sizeof (target) - 1);
+        if (n < 0)
+            continue;
+        target[n] = '\0';
+
+        struct stat st;
+        if (!strncmp(target, dir, strlen(dir)) && !fstat(atoi(e->d_name), &st))
+            kb = st.st_blocks / 2;
+    }
+    if (d)
+        closedir(d);
+    return kb;
+}
+
+/* Mappings of the spill file created in dir */
+static size_t spill_mappings(const char *dir)
+{
+    FILE *f = fopen("/proc/self/maps", "r");
+    char line[PATH_MAX + 128];
+    size_t n = 0;
+
+    while (f && fgets(line, sizeof (line), f))
+        n += strstr(line, dir) != NULL;
+    if (f)
+        fclose(f);
+    return n;
+}
+
+Test(queue, spill)
+{
+    char dir[] = "/tmp/paralull-test-XXXXXX";
+    cr_assert_not_null(mkdtemp(dir), "Could not create spill directory");
+
+    struct pll_queue_opts opts = {
+        .spill_dir = dir,
+        .spill_resident = 8,
+    };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create spilling queue");
+
+    /* Well past the resident window, and across several file mappings */
+    const size_t count = 200 * 4096;
+    const long backlog_kb = count * 3 * sizeof (void *) / 1024;
+    long rss = status_kb("VmRSS:");
+
+    for (size_t i = 1; i <= count; ++i)
+        pll_enqueue(queue, (void *) i);
+    cr_assert_lt(status_kb("VmRSS:") - rss, backlog_kb / 4,
+            "Backlog of %ld KB was not paged out", backlog_kb);
+
+    for (size_t i = 1; i <= count; ++i)
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+    cr_assert(pll_queue_empty(queue), "Drained queue is not empty");
+    cr_assert_lt(spill_file_kb(dir), backlog_kb / 2,
+            "Drained segments were not released from the spill file");
+
+    /* Disk use follows the backlog, not what went through the queue */
+    for (size_t i = 1; i <= 4 * count; ++i) {
+        pll_enqueue(queue, (void *) i);
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+    }
+    cr_assert_lt(spill_file_kb(dir), backlog_kb / 2,
+            "Spill file grew without a backlog");
+    /* Same for address space: drained chunks are unmapped */
+    cr_assert_leq(spill_mappings(dir), 4, "Drained chunks are still mapped");
+
+    pll_queue_term(queue);
+
+    /* The spill file is unlinked as soon as it is created */
+    DIR *d = opendir(dir);
+    size_t entries = 0;
+    for (struct dirent *e; (e = readdir(d)); )
+        entries += e->d_name[0] != '.';
+    closedir(d);
+    rmdir(dir);
+    cr_assert_eq(entries, 0, "Spill file was left behind");
+}
+
+static void *enqueue_segments(void *ctx)
+{
+    pll_queue queue = ctx;
+    for (size_t i = 2; i <= 40 * 4096 + 1; ++i)
+        pll_enqueue(queue, (void *) i);
+    return NULL;
+}
+
+Test(queue, spill_stale_tail)
+{
+    char dir[] = "/tmp/paralull-test-XXXXXX";
+    cr_assert_not_null(mkdtemp(dir), "Could not create spill directory");
+
+    struct pll_queue_opts opts = { .spill_dir = dir, .spill_resident = 8 };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create spilling queue");
+
+    /* Our tail stays on the first segment while another thread fills 40 */
+    pll_enqueue(queue, (void *) 1);
+    pthread_t thread;
+    cr_assert(!pthread_create(&thread, NULL, enqueue_segments, queue),
+            "Could not create producer thread");
+    pthread_join(thread, NULL);
+    for (size_t i = 1; i <= 40 * 4096 + 1; ++i)
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+
+    /* cleanup() must have moved our tail before releasing its segment */
+    size_t segments = pll_queue_segments(queue);
+    pll_enqueue(queue, (void *) 42);
+    cr_assert_eq(pll_dequeue(queue), (void *) 42, "Item was lost");
+    cr_assert_leq(pll_queue_segments(queue), segments + 1, "Segment list forked");
+
+    pll_queue_term(queue);
+    rmdir(dir);
+}
+
+static void *enqueue_once(void *ctx)
+{
+    pll_enqueue(ctx, (void *) 1);
+    return NULL;
+}
+
+Test(queue, spill_idle_producer)
+{
+    char dir[] = "/tmp/paralull-test-XXXXXX";
+    cr_assert_not_null(mkdtemp(dir), "Could not create spill directory");
+
+    struct pll_queue_opts opts = { .spill_dir = dir, .spill_resident = 8 };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create spilling queue");
+
+    /* A producer that goes quiet must not pin the segments after it */
+    pthread_t thread;
+    cr_assert(!pthread_create(&thread, NULL, enqueue_once, queue),
+            "Could not create producer thread");
+    pthread_join(thread, NULL);
+    cr_assert_eq(pll_dequeue(queue), (void *) 1, "Queue does not respect ordering");
+
+    const size_t count = 800 * 4096;
+    for (size_t i = 1; i <= count; ++i) {
+        pll_enqueue(queue, (void *) i);
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Queue does not respect ordering");
+    }
+    long traffic_kb = count * 3 * sizeof (void *) / 1024;
+    cr_assert_lt(spill_file_kb(dir), traffic_kb / 8,
+            "Spill file grew with traffic behind an idle producer");
+
+    pll_queue_term(queue);
+    rmdir(dir);
+}
+
+Test(queue, lanes)
+{
+    struct pll_queue_opts opts = { .lanes = 3 };
+    pll_queue queue = pll_queue_init_opts(&opts);
+    cr_assert_not_null(queue, "Could not create queue with priority lanes");
+
+    for (size_t i = 1; i <= 100; ++i)
+        pll_enqueue(queue, (void *) i);
+    pll_enqueue_prio(queue, (void *) 1001, 1);
+    pll_enqueue_prio(queue, (void *) 2001, 2);
+    pll_enqueue_prio(queue, (void *) 1002, 1);
+    /* Out of range priorities land in the highest lane */
+    pll_enqueue_prio(queue, (void *) 2002, 7);
+    cr_assert_eq(pll_queue_size_approx(queue), 104, "Wrong size across lanes");
+
+    void *urgent[] = {(void *) 2001, (void *) 2002, (void *) 1001, (void *) 1002};
+    for (size_t i = 0; i < sizeof (urgent) / sizeof (void *); ++i)
+        cr_assert_eq(pll_dequeue(queue), urgent[i], "Priorities were not respected");
+    for (size_t i = 1; i <= 100; ++i)
+        cr_assert_eq(pll_dequeue(queue), (void *) i, "Bulk lane does not respect ordering");
+    cr_assert(pll_queue_empty(queue), "Drained queue is not empty");
+
+    pll_queue_term(queue);
+
+    opts.lanes = PLL_QUEUE_MAX_LANES + 1;
+    cr_assert_null(pll_queue_init_opts(&opts), "Too many lanes were accepted");
+}
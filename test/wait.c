@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <paralull.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NB_QUEUES 3
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3
+        + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+Test(wait, timeout)
+{
+    pll_queue queues[NB_QUEUES];
+    for (size_t i = 0; i < NB_QUEUES; ++i)
+        queues[i] = pll_queue_init();
+
+    size_t index = 0;
+    cr_assert_eq(pll_dequeue_any(queues, NB_QUEUES, 0, &index, PLL_ANY_ORDERED),
+            PLL_QUEUE_EMPTY, "Empty queues returned an item");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cr_assert_eq(pll_dequeue_any(queues, NB_QUEUES, 50, &index, PLL_ANY_ORDERED),
+            PLL_QUEUE_EMPTY, "Empty queues returned an item");
+    cr_assert_geq(elapsed_ms(&start), 49, "Returned before the timeout");
+
+    for (size_t i = 0; i < NB_QUEUES; ++i)
+        pll_queue_term(queues[i]);
+}
+
+Test(wait, fairness)
+{
+    pll_queue queues[NB_QUEUES];
+    for (size_t i = 0; i < NB_QUEUES; ++i) {
+        queues[i] = pll_queue_init();
+        for (size_t j = 0; j < 10; ++j)
+            pll_enqueue(queues[i], (void *) (i + 1));
+    }
+
+    size_t index = 0;
+    for (size_t j = 0; j < 5; ++j) {
+        void *val = pll_dequeue_any(queues, NB_QUEUES, 0, &index, PLL_ANY_ORDERED);
+        cr_assert_eq(val, (void *) 1, "Ordered mode did not favour the first queue");
+        cr_assert_eq(index, 0, "Wrong queue index");
+    }
+
+    /* Rotating mode visits every busy queue in turn */
+    for (size_t j = 0; j < 2 * NB_QUEUES; ++j) {
+        void *val = pll_dequeue_any(queues, NB_QUEUES, 0, &index, PLL_ANY_ROTATE);
+        cr_assert_eq(index, (j + 1) % NB_QUEUES, "Queue was skipped");
+        cr_assert_eq(val, (void *) (index + 1), "Item does not match its queue");
+    }
+
+    for (size_t i = 0; i < NB_QUEUES; ++i)
+        pll_queue_term(queues[i]);
+}
+
+static void *delayed_enqueue(void *ctx)
+{
+    pll_queue queue = ctx;
+    struct timespec delay = { .tv_nsec = 20000000 };
+    nanosleep(&delay, NULL);
+    pll_enqueue(queue, (void *) 42);
+    return NULL;
+}
+
+Test(wait, wakeup, .timeout = 5)
+{
+    pll_queue queues[NB_QUEUES];
+    for (size_t i = 0; i < NB_QUEUES; ++i)
+        queues[i] = pll_queue_init();
+
+    pthread_t thread;
+    cr_assert(!pthread_create(&thread, NULL, delayed_enqueue, queues[2]),
+            "Could not create producer thread");
+
+    size_t index = 0;
+    void *val = pll_dequeue_any(queues, NB_QUEUES, -1, &index, PLL_ANY_ORDERED);
+    cr_assert_eq(val, (void *) 42, "Woke up without the item");
+    cr_assert_eq(index, 2, "Wrong queue index");
+
+    pthread_join(thread, NULL);
+    for (size_t i = 0; i < NB_QUEUES; ++i)
+        pll_queue_term(queues[i]);
+}
+
+static bool alloc_failing;
+
+static void *flaky_alloc(size_t size, void *ctx)
+{
+    (void) ctx;
+    return alloc_failing ? NULL : malloc(size);
+}
+
+static void flaky_free(void *ptr, size_t size, void *ctx)
+{
+    (void) size;
+    (void) ctx;
+    free(ptr);
+}
+
+Test(wait, many_queues_nomem)
+{
+    struct pll_queue_opts opts = {
+        .allocator = { .alloc = flaky_alloc, .free = flaky_free },
+    };
+    pll_queue queues[PLL_ANY_STACK_QUEUES + 1];
+    for (size_t i = 0; i < PLL_ANY_STACK_QUEUES + 1; ++i)
+        queues[i] = pll_queue_init_opts(&opts);
+
+    /* Polling does not allocate, only parking on that many queues does */
+    size_t index = 0;
+    alloc_failing = true;
+    errno = 0;
+    cr_assert_eq(pll_dequeue_any(queues, PLL_ANY_STACK_QUEUES + 1, 10, &index,
+                PLL_ANY_ORDERED), PLL_QUEUE_EMPTY, "Empty queues returned an item");
+    cr_assert_eq(errno, ENOMEM, "Allocation failure was not reported");
+    alloc_failing = false;
+
+    errno = 0;
+    cr_assert_eq(pll_dequeue_any(queues, PLL_ANY_STACK_QUEUES + 1, 10, &index,
+                PLL_ANY_ORDERED), PLL_QUEUE_EMPTY, "Empty queues returned an item");
+    cr_assert_eq(errno, 0, "Timeout was reported as an error");
+
+    for (size_t i = 0; i < PLL_ANY_STACK_QUEUES + 1; ++i)
+        pll_queue_term(queues[i]);
+}